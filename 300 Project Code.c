@@ -4,1056 +4,972 @@
  *
  * Created on April 5th, 2024, 9:57 AM
  */
+#ifdef HOST_SIM
+#include "host/sim.h"   // simulated registers for the host build, see host/sim.c
+#else
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/delay_basic.h>
+#include <avr/pgmspace.h>
+#include <avr/xmega.h>
+#endif
+
+#define F_CPU 4000000UL // MCLK runs from OSCHF at its 4MHz reset default, the clock between bursts of work
+
+unsigned long cpuHz = F_CPU;    // current CLK_CPU frequency, only clockSet() changes it
+unsigned char tcaShift = 0;     // TCA0 prescaler steps clockSet() adds so TCA0 counts as it would at F_CPU
 
 // FUNCTION PROTOTYPES for speaker and motor
 void init_speaker_motor();
-void intro_song();
+void play_song(const unsigned char *song);
+/*
+- queues every note of a song stored in flash (see the song format below) and returns
+  once the last one is queued, waits only while the tone queue is full
+- the period of each note comes from tonePeriod[], no floating point
+*/
+void tone_enqueue(unsigned char clksel, unsigned char per, unsigned int periods, unsigned char rest);
+/*
+- adds a note to the tone queue, waits only if the queue is full
+- clksel is the TCA0 clock (CTRLA.CLKSEL) for the note
+- per is the TCA0 LPER value for the pitch, periods is the number of periods it lasts
+- rest = 1 keeps PD1 low for the note instead of sounding it
+*/
+void tone_next();
+/*
+- loads the next queued note into TCA0, or turns the tone off when the queue is empty
+- called from the LUNF interrupt or with interrupts disabled
+*/
+int speaker_busy();
+/*
+- returns 1 while a song is still playing, 0 otherwise
+*/
+void tca_run();
+/*
+- runs TCA0 while the speaker or the motor uses it and stops it otherwise
+- call with interrupts disabled
+*/
+
+// Haptics: a pattern is a list of steps that each hold the motor at a PWM level for a while,
+// the step with ticks = 0 ends it. The scheduler moves from step to step, the PWM runs on its own.
+typedef struct {
+    unsigned char level;    // motor PWM level, 0 off to 255 full
+    unsigned char ticks;    // how long the step lasts in 8 RTC ticks (7.8ms)
+} haptic_t;
+void motor_play(const haptic_t *pattern);
+/*
+- starts a vibration pattern (see haptic_t) on PD5 and returns straight away
+- a pattern that is still playing is cut off
+*/
+void motor_step();
+/*
+- timed task, moves the vibration on to the next step of its pattern
+*/
+void motor_set(unsigned char level);
+/*
+- drives the motor at a PWM level from 0 (off) to 255 (full)
+*/
+int motor_busy();
+/*
+- returns 1 while a vibration pattern is playing, 0 otherwise
+*/
+
+// FUNCTION PROTOTYPES for timing and sleep
+// The 16-bit RTC registers are read and written a byte at a time through the one RTC.TEMP byte,
+// so outside interrupts they are only touched with interrupts disabled: the ADC interrupt reads
+// RTC.CNT and would corrupt an access it lands in the middle of
+uint16_t rtcCount();
+/*
+- returns RTC.CNT, the low half of uptimeTicks(), safe from interrupts
+- leaves the interrupt enable as it found it
+*/
+unsigned long uptimeTicks();
+/*
+- returns the RTC ticks (1/1024s) since initClock(), never goes backwards
+- deadlines are uptimeTicks() values, time left is deadline - uptimeTicks()
+*/
+unsigned long uptimeMs();
+/*
+- returns the milliseconds since initClock()
+*/
+void waitUntil(unsigned long deadline);
+/*
+- sleeps until uptimeTicks() reaches deadline, other interrupts are handled along the way
+*/
+void wakeAfter(unsigned int ticks);
+/*
+- arms the RTC compare to wake the core ticks from now (at least 3 ticks, at most 32767)
+*/
+void sleepUntilEvent();
+/*
+- puts the core to sleep until any interrupt, must be called with interrupts disabled
+- uses standby when nothing needs CLK_PER, idle while a song plays or the UI waits on a button
+- returns with interrupts enabled
+*/
+void clockSet(unsigned char state);
+/*
+- switches MCLK to a state of the clock plan, CLOCK_SLOW or CLOCK_FAST, and tells the
+  LCD, TCA0 and ADC drivers the new frequency
+*/
+void resetSessionStats();
+/*
+- zeroes the wakeup and active cycle counts at the start of a session
+*/
+unsigned long sessionActiveCycles();
+/*
+- returns the CPU cycles spent awake since resetSessionStats()
+*/
+
+// FUNCTION PROTOTYPES for the scheduler
+void schedule(void (*run)(void), unsigned int ticks);
+/*
+- runs run() from the main loop ticks / 1024 seconds from now, scheduling it again moves it
+*/
+void scheduleAt(void (*run)(void), unsigned long deadline);
+/*
+- runs run() once uptimeTicks() reaches deadline, straight away if it already has
+- deadline has to be within 32s
+*/
+void cancelTask(void (*run)(void));
+/*
+- forgets a task that has not run yet
+*/
+void runDueTasks();
+/*
+- runs every timed task whose time has come
+*/
+void idle();
+/*
+- sleeps until the next button event or timed task is due
+*/
+
+// FUNCTION PROTOTYPES for the buttons
+int buttonEvent();
+/*
+- returns the next debounced press (button code) or release (code | 0b10000000), 0 if none
+- never waits, events are queued by the ADC interrupt
+*/
+void buttonsWatch(unsigned char on);
+/*
+- on = 1 samples the ladder 16 times a second, also in standby, on = 0 stops once no button is down
+- between presses only the ADC window comparator can wake the core, see ADC0_WCMP_vect
+*/
+int buttonTracking();
+/*
+- returns 1 while a button is down or settling, the ADC then converts nonstop and the core has to idle
+*/
+
+// FUNCTION PROTOTYPES for the trace channel, build with -DTRACE to send it
+// Every event is 4 bytes: its type, RTC.CNT (1/1024s, low byte first) and one argument
+#define TRACE_TICK   0xf1   // countdown second, arg = digits that changed (see countdownStep())
+#define TRACE_BUTTON 0xf2   // button event, arg = press or release code
+#define TRACE_PHASE  0xf3   // session state entered, arg = STATE_...
+#define TRACE_FLUSH  0xf4   // frameFlush(), arg = LCD cells written
+#define TRACE_DROP   0xf5   // events dropped before this one, arg = count (255 for 255 or more)
+#define TRACE_BENCH  0xf6   // -DBENCHMARK result, microseconds in place of RTC.CNT, arg = see benchReport()
+#ifdef TRACE
+void initTrace();
+/*
+- starts USART1 sending on PC0 at TRACE_BAUD, 8N1
+*/
+void trace(unsigned char type, unsigned char arg);
+/*
+- queues a 4 byte event (type, RTC.CNT low and high byte, arg) for USART1 and returns
+  straight away, the USART interrupts send it
+- never waits: when the queue is full the event is dropped and counted, the count goes
+  out as a TRACE_DROP event once there is room again
+*/
+void traceEvent(unsigned char type, unsigned int value, unsigned char arg);
+/*
+- same as trace() with value sent in place of RTC.CNT
+*/
+int traceBusy();
+/*
+- returns 1 while events are still being sent, USART1 needs CLK_PER and a steady clock
+*/
+#else
+#define trace(type, arg) ((void)(arg))
+#define traceEvent(type, value, arg) ((void)(value))
+#define traceBusy() 0
+#endif
+
+// Profiling probes, build with -DPROFILE to count them: PROBE_ENTER(id) at the top of a routine
+// and PROBE_EXIT(id) on its way out time it on TCB1, the active cycle counter. Interrupts that
+// land in between are counted too, time asleep is not. Calls over 65535 cycles come out short.
+// Without -DPROFILE both compile to nothing.
+#define PROBE_ENABLE     0  // enable(), one LCD strobe
+#define PROBE_PRINT      1  // print(), one character
+#define PROBE_SPEAKER    2  // play_song(), what every sound goes through now
+#define PROBE_MOTOR      3  // motor_play()
+#define PROBE_TIMER_TICK 4  // timerTick(), one second of the countdown
+#define PROBE_COUNT      5
+#define PROBE_SELF       PROBE_COUNT    // an empty ENTER/EXIT pair, timed by resetProbes()
+#ifdef PROFILE
+typedef struct {
+    unsigned long calls;
+    unsigned long total;    // cycles in all calls
+    uint16_t min, max;      // cycles in the shortest and longest call
+    uint16_t start;         // TCB1.CNT at PROBE_ENTER
+} probe_t;
+probe_t probes[PROBE_COUNT + 1];
+uint16_t probeCost = 0;     // cycles one PROBE_ENTER/PROBE_EXIT pair adds to its caller
+#define PROBE_ENTER(id) (probes[id].start = TCB1.CNT)
+#define PROBE_EXIT(id) probeExit(id)
+void probeExit(unsigned char id);
+/*
+- adds the cycles since PROBE_ENTER(id) to probes[id]
+*/
+void resetProbes();
+/*
+- zeroes every probe, done with the session stats
+- times an empty probe into probeCost, on the part this is the real cost of probing a call
+*/
+#else
+#define PROBE_ENTER(id)
+#define PROBE_EXIT(id)
+#endif
+
+// FUNCTION PROTOTYPES for the number spinner
+void spinnerOpen(int row, int col, int digits, int min, int max, int value);
 /*
-- plays the song for when studybuddy is first turned on 
+- shows an editor for a number of 1 to 4 digits at row, col on the LCD, starting at value
+- left/right move the cursor between digits, up/down turn the digit under it
+- a digit wraps from 9 to 0 and back, values outside min..max are skipped
 */
-void study_song();
+int spinnerKey(int event);
 /*
-- plays the song for beginning a study session 
+- handles a press or release for the open spinner, returns 1 when select is pressed
+- a held up/down repeats, faster the longer it is held
 */
-void break_song();
+
+// FUNCTION PROTOTYPES for the saved settings
+int settingsLoad();
 /*
-- plays the song for beginning a break session
+- loads the last confirmed study time, break time and rotations from EEPROM into userStudy,
+  userBreak and userRotations, returns 0 (and leaves them alone) if none were saved
 */
-void end_song();
+void settingsSave();
 /*
-- plays the song for when studdybuddy has finished every cycle  
+- saves userStudy, userBreak and userRotations to EEPROM if they changed, takes a few
+  EEPROM write times (waits for each byte)
 */
-void play_note(char note, double length); 
-/* 
-- receives character and length of desired note, plays note for that length of time
-- converts character into specific frequency per note
-- can only receive C, D, E, F, G, A, B, H
-- these begin from middle C and end at C an octave above, H = C
+
+// FUNCTION PROTOTYPES for the session history
+void historyLoad();
+/*
+- finds the newest session record in EEPROM, its totals become the running totals
 */
-void speaker_output(unsigned int freq, double length); 
+void historyStart();
 /*
-- receives an integer and double input of a specific frequency with its length
-- outputs a square wave of duty cycle 50% to speaker
-- uses clock and timer to do so 
+- appends an open record for a session that starts now with the user settings
 */
-void play_pause(double length);
+void historyStudyDone();
 /*
-- generates a pause of length * 1 second
+- adds a completed study phase to the current record and to the focus total
 */
-void motor_buzz();
+void historyClose();
 /*
-- produces a short 2 burst vibration 
+- marks the current record completed, a record left open was cut short
 */
 
+// TCA0 runs in split mode so the speaker and the motor can share it: the low counter makes
+// the tone on WO1 (PD1) and the high counter the motor PWM on WO5 (PD5), both on the same
+// clock, CLK_PER / 64 unless a note needs another one.
+// Tone engine: f_out = TCA0 clock / (LPER + 1), rounding LPER keeps the 262-523Hz songs
+// within 0.4% of pitch
+#define TONE_CLKSEL 0b101                   // CLK_PER / 64, clock of both 8 bit counters
+#define TONE_QUEUE_SIZE 8                   // notes waiting to be played, must be a power of 2
+#define TONE_REST_PER 249                   // LPER during a pause, one underflow every 4ms at CLK_PER / 64
+
+typedef struct {
+    unsigned char clksel;   // TCA0 clock for the note
+    unsigned char per;      // LPER value, sets the pitch
+    unsigned int periods;   // underflows (whole periods) left before the next note
+    unsigned char rest;     // 1 for a pause, 0 for a note
+} tone_t;
+
+// Song format: 2 bytes per note in flash, NOTE(name, octave, length) or REST(length), then SONG_END.
+// The first byte holds the octave - SONG_OCTAVE_LOW in the high nibble and the note (0-11 from C,
+// 12 for a rest) in the low nibble, the second the length in SONG_TICK_MS steps (up to 2.55s).
+#define SONG_TICK_MS 10
+#define SONG_OCTAVE_LOW 3       // octaves 3 to 6, C3 (131Hz) to B6 (1976Hz)
+#define SONG_OCTAVES 4
+#define SONG_END 0xff
+#define NOTE_C 0
+#define NOTE_Cs 1
+#define NOTE_D 2
+#define NOTE_Ds 3
+#define NOTE_E 4
+#define NOTE_F 5
+#define NOTE_Fs 6
+#define NOTE_G 7
+#define NOTE_Gs 8
+#define NOTE_A 9
+#define NOTE_As 10
+#define NOTE_B 11
+#define NOTE_REST 12
+#define NOTE(name, octave, length) (((octave) - SONG_OCTAVE_LOW) << 4 | NOTE_##name), (length)
+#define REST(length) NOTE(REST, 6, length)    // octave 6 ticks every 1ms during a rest
+
+// Period table, worked out by the compiler: LPER for each note at its octave's TCA0 clock.
+// f is the note in centihertz at octave 4, octave 3 runs from CLK_PER / 256, 4 and 5 from
+// CLK_PER / 64 and 6 from CLK_PER / 16 so every period fits in 8 bits, all within 0.55% of pitch
+#define TONE_PER(f, octave, div) \
+    ((F_CPU * 1600ULL / (div) + ((unsigned long long)(f) << (octave)) / 2) / ((unsigned long long)(f) << (octave)) - 1)
+#define TONE_OCTAVE(octave, div) { \
+    TONE_PER(26163, octave, div), TONE_PER(27718, octave, div), TONE_PER(29366, octave, div), \
+    TONE_PER(31113, octave, div), TONE_PER(32963, octave, div), TONE_PER(34923, octave, div), \
+    TONE_PER(36999, octave, div), TONE_PER(39200, octave, div), TONE_PER(41530, octave, div), \
+    TONE_PER(44000, octave, div), TONE_PER(46616, octave, div), TONE_PER(49388, octave, div), \
+    TONE_REST_PER }
+
+const unsigned char tonePeriod[SONG_OCTAVES][13] PROGMEM = {
+    TONE_OCTAVE(3, 256),
+    TONE_OCTAVE(4, 64),
+    TONE_OCTAVE(5, 64),
+    TONE_OCTAVE(6, 16),
+};
+const unsigned char toneClksel[SONG_OCTAVES] PROGMEM = {0b110, 0b101, 0b101, 0b100};
+const unsigned char toneShift[SONG_OCTAVES] PROGMEM = {8, 6, 6, 4};   // log2 of the divider
+
+// Songs
+const unsigned char introSong[] PROGMEM = {NOTE(G, 4, 70), NOTE(C, 4, 35), NOTE(E, 4, 35), NOTE(A, 4, 120), SONG_END};
+const unsigned char studySong[] PROGMEM = {NOTE(F, 4, 35), NOTE(D, 4, 35), NOTE(A, 4, 35), NOTE(C, 5, 50), SONG_END};
+const unsigned char breakSong[] PROGMEM = {NOTE(D, 4, 35), NOTE(F, 4, 35), NOTE(E, 4, 35), NOTE(C, 4, 50), SONG_END};
+const unsigned char endSong[] PROGMEM = {NOTE(A, 4, 35), NOTE(G, 4, 35), NOTE(B, 4, 35), NOTE(C, 5, 70), SONG_END};
+
+volatile tone_t tone_queue[TONE_QUEUE_SIZE];
+volatile unsigned char tone_head = 0;       // next note to be played
+volatile unsigned char tone_tail = 0;       // next free slot in the queue
+volatile unsigned int tone_left = 0;        // underflows left in the current note
+volatile unsigned char tone_playing = 0;    // 1 while TCA0 is running a note
+volatile unsigned char tone_clksel = TONE_CLKSEL;   // TCA0 clock of the current note
+unsigned char motorLevel = 0;               // motor PWM level, TCA0 keeps running while it is not 0
+
 // FUNCTION DEFINITIONS for speaker and motor
 void init_speaker_motor(){
 
-    // Initializes counter
-    TCA0.SINGLE.CTRLA = 0b00000001; // sets the timer counter frequency to CLK_PER / 16
-    TCA0.SINGLE.PER = 0xffff; // sets the top value of the counter to the max possible value for a 16 bit register
+    // Routes TCA0 waveform outputs to PORTD so WO1 lands on the speaker pin PD1 and WO5 on the motor pin PD5
+    PORTMUX.TCAROUTEA = 0b00000011;
+
+    // Initializes counter, left stopped until a note or vibration needs it
+    TCA0.SPLIT.CTRLA = 0b00000000; // timer disabled
+    TCA0.SPLIT.CTRLD = 0b00000001; // split mode, two 8 bit counters
+    TCA0.SPLIT.CTRLB = 0b00000000; // both outputs off
+    TCA0.SPLIT.HPER = 0xff;        // motor PWM at TCA0 clock / 256, 244Hz at CLK_PER / 64
     
     // Initializes outputs for speaker and motor
+    PORTD.OUTCLR = 0b00100010;
     PORTD.DIRSET = 0b00100010;
 
 }
-void intro_song(){
+void play_song(const unsigned char *song){
+    unsigned char code;
+    PROBE_ENTER(PROBE_SPEAKER);
+    while((code = pgm_read_byte(song)) != SONG_END){
+        unsigned char octave = code >> 4;
+        unsigned char note = code & 0b00001111;
+        unsigned char per = pgm_read_byte(&tonePeriod[octave][note]);
+        unsigned long ms = pgm_read_byte(song + 1) * SONG_TICK_MS;
+        // one underflow per period, (TCA0 clock / (per + 1)) * ms / 1000 periods
+        unsigned int periods = ms * (F_CPU >> pgm_read_byte(&toneShift[octave])) / ((per + 1) * 1000UL);
 
-    play_note('G', 0.7);
-    play_note('C', 0.35);
-    play_note('E', 0.35);
-    play_note('A', 1.2);
-    
-}
-void study_song(){
-    play_note('F', 0.35);
-    play_note('D', 0.35);
-    play_note('A', 0.35);
-    play_note('H', 0.5);
-}
-void break_song(){
-    play_note('D', 0.35);
-    play_note('F', 0.35);
-    play_note('E', 0.35);
-    play_note('C', 0.5);
+        tone_enqueue(pgm_read_byte(&toneClksel[octave]), per, periods, note == NOTE_REST);
+        song += 2;
+    }
+    PROBE_EXIT(PROBE_SPEAKER);
 }
-void end_song(){
-    play_note('A', 0.35);
-    play_note('G', 0.35);
-    play_note('B', 0.35);
-    play_note('H', 0.7);
+void tone_enqueue(unsigned char clksel, unsigned char per, unsigned int periods, unsigned char rest){
+    if(periods == 0){
+        return;
+    }
+    while(((tone_tail + 1) & (TONE_QUEUE_SIZE - 1)) == tone_head) ; // queue full, wait for the ISR
+
+    cli();
+    tone_queue[tone_tail].clksel = clksel;
+    tone_queue[tone_tail].per = per;
+    tone_queue[tone_tail].periods = periods;
+    tone_queue[tone_tail].rest = rest;
+    tone_tail = (tone_tail + 1) & (TONE_QUEUE_SIZE - 1);
+    if(!tone_playing){
+        tone_next();
+    }
+    sei();
 }
-void play_note(char note, double length){
-    // this if/else statement plays whatever note is inputed, for length * 1 second 
-    if(note == 'C'){
-        speaker_output(262, length);
-    } else if(note == 'D'){
-        speaker_output(293, length);
-    } else if(note == 'E'){
-        speaker_output(330, length);
-    } else if(note == 'F'){
-        speaker_output(349, length);
-    } else if(note == 'G'){
-        speaker_output(392, length);
-    } else if(note == 'A'){
-        speaker_output(440, length);
-    } else if(note == 'B'){
-        speaker_output(494, length);
-    } else if(note == 'H'){
-        speaker_output(523, length);
+void tone_next(){
+    if(tone_head == tone_tail){
+        // Nothing left to play, leave PD1 low and stop the timer unless the motor uses it
+        TCA0.SPLIT.INTCTRL = 0b00000000;
+        TCA0.SPLIT.CTRLB &= 0b11111101;
+        tone_playing = 0;
+        tca_run();
+        return;
+    }
+
+    tone_clksel = tone_queue[tone_head].clksel;
+    TCA0.SPLIT.LPER = tone_queue[tone_head].per;
+    TCA0.SPLIT.LCMP1 = tone_queue[tone_head].per / 2; // 50% duty
+    TCA0.SPLIT.LCNT = tone_queue[tone_head].per;      // start on a whole period
+    if(tone_queue[tone_head].rest){
+        TCA0.SPLIT.CTRLB &= 0b11111101; // WO1 off, PD1 falls back to PORTD.OUT (low)
+    } else {
+        TCA0.SPLIT.CTRLB |= 0b00000010; // WO1 drives PD1
     }
+    tone_left = tone_queue[tone_head].periods;
+    tone_head = (tone_head + 1) & (TONE_QUEUE_SIZE - 1);
+    tone_playing = 1;
+    TCA0.SPLIT.INTCTRL = 0b00000001; // interrupt on every low counter underflow (period)
+    tca_run();
 }
-void speaker_output(unsigned int freq, double length){
-    // Local variables
-    unsigned int time = 0; // incrementing value to ensure note length of 1 second * length
-    double top_count = 1/(freq*0.0000002); // freq converted into amount of timer counts
-        
-    while(time <= (freq*length)){
-        PORTD.OUT &= 0b11111101;
-        
-        while( TCA0.SINGLE.CNT <= (top_count)/2) ;        
-        TCA0.SINGLE.CNT = 0;
-
-        PORTD.OUT |= 0b00000010;
-        
-        while( TCA0.SINGLE.CNT <= (top_count)/2) ;        
-        TCA0.SINGLE.CNT = 0;
-        time++;
-    }  
+int speaker_busy(){
+    return tone_playing;
 }
-void play_pause(double length){
-    // Local variables
-    unsigned int count = 0; // incrementing value to ensure note length of 1 second * length
-    
-    // Initializing clock
-    CCP = 0xd8;  
-    CLKCTRL.OSCHFCTRLA = 0b00010100;  // sets OSCHF frequency to 8MHz
-    while( CLKCTRL.MCLKSTATUS & 0b00000001 ){   // stalls the CLK_MAIN while its source is switching
-        ;
+ISR(TCA0_LUNF_vect){
+    TCA0.SPLIT.INTFLAGS = 0b00000001;
+    if(--tone_left == 0){
+        tone_next();
     }
-    
-    // Initializes counter
-    TCA0.SINGLE.CTRLA = 0b00001001; // sets the timer counter frequency to CLK_PER / 16
-    TCA0.SINGLE.PER = 0xffff; // sets the top value of the counter to the max possible value for a 16 bit register
-    
-    while(count <= 100){
-        while( TCA0.SINGLE.CNT <= (5000*length)){
-            PORTD.OUT &= 0b11111101;
-        }
-        TCA0.SINGLE.CNT = 0;
-        count++;
+}
+
+void tca_run(){
+    if(tone_playing){
+        TCA0.SPLIT.CTRLA = (tone_clksel + tcaShift) << 1 | 0b00000001; // note's clock, timer enabled
+    } else if(motorLevel){
+        TCA0.SPLIT.CTRLA = (TONE_CLKSEL + tcaShift) << 1 | 0b00000001; // F_CPU / 64, timer enabled
+    } else {
+        TCA0.SPLIT.CTRLA = 0b00000000;
     }
 }
 
 // Motor function definition
-void motor_buzz(){
-    // local variables
-    unsigned int count = 0;
-    
-    PORTD.OUT |= 0b00100000;   
-    while(count <= 50){
-        while( TCA0.SINGLE.CNT <= 10000){}
-        TCA0.SINGLE.CNT = 0;
-        count++;
-    }
-    count = 0;
-        
-    PORTD.OUT &= 0b11011111;
-    while(count <= 700){
-        while( TCA0.SINGLE.CNT <= 1000){}
-        TCA0.SINGLE.CNT = 0;
-        count++;
-    }
-    count = 0;
-    PORTD.OUT |= 0b00100000;   
-    while(count <= 50){
-        while( TCA0.SINGLE.CNT <= 10000){}
-        TCA0.SINGLE.CNT = 0;
-        count++;
-    }
-    count = 0;
-        
-    PORTD.OUT &= 0b11011111;
-    
+// vibration patterns, steps of {level, ticks / 8}
+const haptic_t hapticWelcome[] = {{255, 16}, {0, 22}, {255, 16}, {0, 0}};           // 2 full bursts
+const haptic_t hapticStudy[] = {{90, 12}, {170, 12}, {255, 24}, {0, 0}};            // ramps up
+const haptic_t hapticBreak[] = {{140, 20}, {0, 20}, {140, 20}, {0, 0}};             // 2 soft pulses
+const haptic_t hapticEnd[] = {{255, 12}, {0, 12}, {255, 12}, {0, 12}, {255, 32}, {0, 0}}; // 3 bursts, long last
+
+const haptic_t *motorPattern = 0;   // step playing now, 0 when the motor is idle
+
+void motor_play(const haptic_t *pattern){
+    PROBE_ENTER(PROBE_MOTOR);
+    motorPattern = pattern;
+    motor_set(pattern->level);
+    schedule(motor_step, pattern->ticks * 8);
+    PROBE_EXIT(PROBE_MOTOR);
+}
+void motor_step(){
+    motorPattern++;
+    if(motorPattern->ticks == 0){
+        motorPattern = 0;
+        motor_set(0);   // pattern done, motor off
+        return;
+    }
+    motor_set(motorPattern->level);
+    schedule(motor_step, motorPattern->ticks * 8);
+}
+void motor_set(unsigned char level){
+    cli();
+    if(level){
+        TCA0.SPLIT.HCMP2 = level;
+        TCA0.SPLIT.CTRLB |= 0b01000000; // WO5 drives PD5
+    } else {
+        TCA0.SPLIT.CTRLB &= 0b10111111; // PD5 falls back to PORTD.OUT (low)
+    }
+    motorLevel = level;
+    tca_run();
+    sei();
+}
+int motor_busy(){
+    return motorPattern != 0;
 }
 
 
 //Functions to do with LCD
+char lcdShadow[2][16];      // what the LCD is currently showing
+char lcdFrame[2][16];       // what it should show after the next frameFlush()
+unsigned char lcdAddr = 0;  // copy of the LCD's DDRAM address counter
+
+// HD44780 timing in 4-cycle _delay_loop_2() iterations, worked out from cpuHz by lcdTiming()
+unsigned int lcdPulseLoops;  // EN high time, at least 450ns
+unsigned int lcdExecLoops;   // after an instruction or data write, at least 37us (+10% for a slow module)
+unsigned int lcdClearLoops;  // after clear display, at least 1.52ms (+10%)
+
+// Uncomment if the LCD's R/W pin is wired to PD6 instead of ground. The driver then
+// polls the busy flag and moves on as soon as the LCD is ready instead of waiting out
+// the worst-case execution times above
+//#define LCD_RW_bm 0b01000000
+
+// LCD pins on PORTA, PA1-0 belong to the LEDs. Pins are only changed through OUTSET/OUTCLR
+// or single-bit VPORTA writes (SBI/CBI), so an interrupt touching the other pins of the
+// port in the middle can't be undone
+#define LCD_DATA_gm 0b11110000  // PA7-4 -> DB7-4
+#define LCD_RS_bm   0b00001000  // PA3 -> RS
+#define LCD_EN_bm   0b00000100  // PA2 -> EN
+
+#define LCD_POWER_UP_TICKS 41   // 40ms on the 1.024kHz RTC, the HD44780's minimum after power-up
+
+unsigned int usToLoops(unsigned int us){
+    unsigned long loops = ((unsigned long)us * (cpuHz / 1000) + 3999) / 4000;
+    if(loops == 0){
+        loops = 1;
+    } else if(loops > 0xffff){
+        loops = 0xffff;
+    }
+    return loops;
+}                    //converts us microseconds into delay loops at cpuHz, rounded up. Should not be called by user
+void lcdTiming(){
+    lcdPulseLoops = usToLoops(1);
+    lcdExecLoops = usToLoops(41);
+    lcdClearLoops = usToLoops(1670);
+}                    //recomputes the LCD delays, run after cpuHz changes
+void lcdDelay(unsigned int loops){
+    _delay_loop_2(loops);
+}                    //waits loops * 4 CPU cycles. Should not be called by user
 void enable(){
-    unsigned long counter=0;
-    while(counter < 450){counter++;} // must exceed 230ns
-    PORTA.OUT |= 0b00000100;
-    counter=0;
-    while(counter < 450){counter++;} // must exceed 270ns
-    PORTA.OUT &= 0b11111011;
+    PROBE_ENTER(PROBE_ENABLE);
+    VPORTA.OUT |= LCD_EN_bm;
+    lcdDelay(lcdPulseLoops); // must exceed 450ns
+    VPORTA.OUT &= ~LCD_EN_bm;
+    PROBE_EXIT(PROBE_ENABLE);
 }                    //updates LCD. Should not be called by user
-void clearDisplay(){
-    PORTA.OUT &= 0b00000011;
-    enable();
-    PORTA.OUT |= 0b00010000;
-    PORTA.OUT &= 0b00010011;
+void lcdWait(unsigned int loops){
+#ifdef LCD_RW_bm
+    unsigned char busy;
+    PORTA.DIRCLR = LCD_DATA_gm; // DB7-4 now drive PA7-4
+    PORTA.OUTCLR = LCD_RS_bm;   // RS low to read the busy flag
+    VPORTD.OUT |= LCD_RW_bm;     // SBI, R/W high to read
+    do{
+        VPORTA.OUT |= LCD_EN_bm;
+        lcdDelay(lcdPulseLoops);
+        busy = VPORTA.IN & 0b10000000; // busy flag is on DB7 in the high nibble
+        VPORTA.OUT &= ~LCD_EN_bm;
+        enable();                     // the low nibble has to be clocked out too
+    } while(busy);
+    VPORTD.OUT &= ~LCD_RW_bm;
+    PORTA.DIRSET = LCD_DATA_gm;
+#else
+    lcdDelay(loops);
+#endif
+}                    //waits until the LCD can take the next write. Should not be called by user
+void stepAddr(int right){
+    if(right){
+        lcdAddr++;
+        if(lcdAddr == 0x28){ lcdAddr = 0x40; }
+        else if(lcdAddr == 0x68){ lcdAddr = 0x00; }
+    } else {
+        if(lcdAddr == 0x00){ lcdAddr = 0x67; }
+        else if(lcdAddr == 0x40){ lcdAddr = 0x27; }
+        else { lcdAddr--; }
+    }
+}                    //follows the LCD's address counter one step. Should not be called by user
+void trackChar(char c){
+    unsigned char row = lcdAddr >> 6;
+    unsigned char col = lcdAddr & 0b00111111;
+    if(col < 16){
+        lcdShadow[row][col] = c;
+        lcdFrame[row][col] = c;
+    }
+    stepAddr(1);
+}                    //records a character written at the cursor. Should not be called by user
+void lcdNibble(unsigned char bits){
+    PORTA.OUTCLR = ~bits & (LCD_DATA_gm | LCD_RS_bm);
+    PORTA.OUTSET = bits;
     enable();
+}                    //puts bits (DB7-4 and RS) on PA7-3 in two stores and clocks them in. Should not be called by user
+void lcdWrite(unsigned char b, unsigned char rs){
+    lcdNibble((b & 0b11110000) | rs);
+    lcdNibble((unsigned char)(b << 4) | rs);
+    lcdWait(lcdExecLoops);
+    if(rs){
+        trackChar(b);
+    }
+}                    //sends byte b to PA7-4 as two nibbles, rs = 0b00001000 for data, 0 for a command. Should not be called by user
+void ddramAddress(unsigned char addr){
+    lcdWrite(0b10000000 | addr, 0);  // Set DDRAM Address
+    lcdAddr = addr;
+}                    //jumps the cursor to DDRAM address addr. Should not be called by user
+void clearDisplay(){
+    lcdWrite(0b00000001, 0);
+    lcdWait(lcdClearLoops);
+    for(int row = 0; row < 2; row++){
+        for(int col = 0; col < 16; col++){
+            lcdShadow[row][col] = ' ';
+            lcdFrame[row][col] = ' ';
+        }
+    }
+    lcdAddr = 0;
 }              //Clears display, resets cursor to top left
 void initDisplay() {
     PORTA.DIRSET = 0b11111111;  // PA7-4 -> DB7-4
     // Enables PA7-2 for output    PA3   -> RS
     //                             PA2   -> EN
-    unsigned long counter=0;
-    while(counter < 5000){
-        counter++;
-    }
+#ifdef LCD_RW_bm
+    PORTD.DIRSET = LCD_RW_bm;
+#endif
+    lcdTiming();
+    while(rtcCount() < LCD_POWER_UP_TICKS){
+        lcdDelay(usToLoops(1000));
+    }   // LCD needs 40ms after power-up, the RTC has counted since initClock()
     //Enter 4-bit mode
-    PORTA.OUT |= 0b00100000;
-    PORTA.OUT &= 0b00100011;
-    enable();
+    lcdNibble(0b00100000);
+    lcdDelay(lcdExecLoops);     // busy flag can't be read before 4-bit mode
     //Function set
-    PORTA.OUT |= 0b00100000;
-    PORTA.OUT &= 0b00100011;
-    enable();
-    PORTA.OUT |= 0b10000000;
-    PORTA.OUT &= 0b10000011;
-    enable();
+    lcdWrite(0b00101000, 0);
     //Display On/Off Control
-    PORTA.OUT &= 0b00000011;
-    enable();
-    PORTA.OUT |= 0b11100000;
-    //PORTA.OUT |= 0b11000000; //comment out above line and uncomment this one to disable cursor
-    PORTA.OUT &= 0b11100011;
-    enable();
+    lcdWrite(0b00001110, 0);
+    //lcdWrite(0b00001100, 0); //comment out above line and uncomment this one to disable cursor
     //Entry mode set
-    PORTA.OUT &= 0b00000011;
-    enable();
-    PORTA.OUT |= 0b01100000;
-    PORTA.OUT &= 0b01100011;
-    enable();
+    lcdWrite(0b00000110, 0);
     clearDisplay();
 }             //Initializes display on pins PA7-2. RUN ONLY ONCE
+void setCursor(int row, int col){
+    if(row < 0 || row > 1 || col < 0 || col > 39){
+        return;
+    }
+    ddramAddress(row * 0x40 + col);
+}               //Moves cursor to row (0-1), col (0-39) with one command
 void resetCursor(){
-    PORTA.OUT &= 0b00000011;
-    enable();
-    PORTA.OUT |= 0b00100000;
-    PORTA.OUT &= 0b00100011;
-    enable();
+    setCursor(0, 0);
 }               //Resets cursor, does not clear display
 void cursorRight(int x){
     for(int i = 0;i<x;i++){
-        PORTA.OUT |= 0b00010000;
-        PORTA.OUT &= 0b00010011;
-        enable();
-        PORTA.OUT |= 0b01000000;
-        PORTA.OUT &= 0b01000011;
-        enable();
+        lcdWrite(0b00010100, 0);
+        stepAddr(1);
     }
 }         //Moves cursor right x times
 void cursorLeft(int x){
     for(int i = 0; i<x; i++){
-        PORTA.OUT |= 0b00010000;
-        PORTA.OUT &= 0b00010011;
-        enable();
-        PORTA.OUT &= 0b00000011;
-        enable();
+        lcdWrite(0b00010000, 0);
+        stepAddr(0);
     }
 }           //Moves cursor left x times
 void cursorRow(){
-    cursorRight(40);
+    setCursor(!(lcdAddr >> 6), lcdAddr & 0b00111111);
 }                 //Switches the cursor's current row
 void print(int x){
-    switch(x){
-         case ' ':
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            PORTA.OUT |= 0b00001000;
-            PORTA.OUT &= 0b00001011;
-            enable();
-            break;
-         case '!':
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            PORTA.OUT |= 0b00011000;
-            PORTA.OUT &= 0b00011011;
-            enable();
-            break;
-         case '"':
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            break;
-         case '#':
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            break;
-         case '$':
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            break;
-         case '%':
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            break;
-         case '&':
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            break;
-         case '\'':
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            break;
-         case '(':
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            PORTA.OUT |= 0b10001000;
-            PORTA.OUT &= 0b10001011;
-            enable();
-            break;
-         case ')':
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            PORTA.OUT |= 0b10011000;
-            PORTA.OUT &= 0b10011011;
-            enable();
-            break;
-         case '*':
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            PORTA.OUT |= 0b10101000;
-            PORTA.OUT &= 0b10101011;
-            enable();
-            break;
-         case '+':
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            PORTA.OUT |= 0b10111000;
-            PORTA.OUT &= 0b10111011;
-            enable();
-            break;
-         case ',':
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            PORTA.OUT |= 0b11001000;
-            PORTA.OUT &= 0b11001011;
-            enable();
-            break;
-         case '-':
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            PORTA.OUT |= 0b11011000;
-            PORTA.OUT &= 0b11011011;
-            enable();
-            break;
-         case '.':
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            PORTA.OUT |= 0b11101000;
-            PORTA.OUT &= 0b11101011;
-            enable();
-            break;
-         case '/':
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            PORTA.OUT |= 0b11111000;
-            PORTA.OUT &= 0b11111011;
-            enable();
-            break;
-         case 0:
-         case '0':
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            PORTA.OUT |= 0b00001000;
-            PORTA.OUT &= 0b00001011;
-            enable();
-            break;
-         case 1:
-         case '1':
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            PORTA.OUT |= 0b00011000;
-            PORTA.OUT &= 0b00011011;
-            enable();
-            break;
-         case 2:
-         case '2':
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            break;
-         case 3:
-         case '3':
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            break;
-         case 4:
-         case '4':
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            break;
-         case 5:
-         case '5':
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            break;
-         case 6:
-         case '6':
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            break;
-         case 7:
-         case '7':
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            break;
-         case 8:
-         case '8':
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            PORTA.OUT |= 0b10001000;
-            PORTA.OUT &= 0b10001011;
-            enable();
-            break;
-         case 9:
-         case '9':
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            PORTA.OUT |= 0b10011000;
-            PORTA.OUT &= 0b10011011;
-            enable();
-            break;
-         case ':':
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            PORTA.OUT |= 0b10101000;
-            PORTA.OUT &= 0b10101011;
-            enable();
-            break;
-         case ';':
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            PORTA.OUT |= 0b10111000;
-            PORTA.OUT &= 0b10111011;
-            enable();
-            break;
-         case '<':
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            PORTA.OUT |= 0b11001000;
-            PORTA.OUT &= 0b11001011;
-            enable();
-            break;
-         case '=':
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            PORTA.OUT |= 0b11011000;
-            PORTA.OUT &= 0b11011011;
-            enable();
-            break;
-         case '>':
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            PORTA.OUT |= 0b11101000;
-            PORTA.OUT &= 0b11101011;
-            enable();
-            break;
-         case '?':
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            PORTA.OUT |= 0b11111000;
-            PORTA.OUT &= 0b11111011;
-            enable();
-            break;
-         case '@':
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            PORTA.OUT |= 0b00001000;
-            PORTA.OUT &= 0b00001011;
-            enable();
-            break;
-         case 'A':
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            PORTA.OUT |= 0b00011000;
-            PORTA.OUT &= 0b00011011;
-            enable();
-            break;
-         case 'B':
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            break;
-         case 'C':
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            break;
-         case 'D':
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            break;
-         case 'E':
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            break;
-         case 'F':
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            break;
-         case 'G':
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            break;
-         case 'H':
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            PORTA.OUT |= 0b10001000;
-            PORTA.OUT &= 0b10001011;
-            enable();
-            break;
-         case 'I':
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            PORTA.OUT |= 0b10011000;
-            PORTA.OUT &= 0b10011011;
-            enable();
-            break;
-         case 'J':
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            PORTA.OUT |= 0b10101000;
-            PORTA.OUT &= 0b10101011;
-            enable();
-            break;
-         case 'K':
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            PORTA.OUT |= 0b10111000;
-            PORTA.OUT &= 0b10111011;
-            enable();
-            break;
-         case 'L':
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            PORTA.OUT |= 0b11001000;
-            PORTA.OUT &= 0b11001011;
-            enable();
-            break;
-         case 'M':
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            PORTA.OUT |= 0b11011000;
-            PORTA.OUT &= 0b11011011;
-            enable();
-            break;
-         case 'N':
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            PORTA.OUT |= 0b11101000;
-            PORTA.OUT &= 0b11101011;
-            enable();
-            break;
-         case 'O':
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            PORTA.OUT |= 0b11111000;
-            PORTA.OUT &= 0b11111011;
-            enable();
-            break;
-         case 'P':
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            PORTA.OUT |= 0b00001000;
-            PORTA.OUT &= 0b00001011;
-            enable();
-            break;
-         case 'Q':
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            PORTA.OUT |= 0b00011000;
-            PORTA.OUT &= 0b00011011;
-            enable();
-            break;
-         case 'R':
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            break;
-         case 'S':
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            break;
-         case 'T':
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            break;
-         case 'U':
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            break;
-         case 'V':
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            break;
-         case 'W':
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            break;
-         case 'X':
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            PORTA.OUT |= 0b10001000;
-            PORTA.OUT &= 0b10001011;
-            enable();
-            break;
-         case 'Y':
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            PORTA.OUT |= 0b10011000;
-            PORTA.OUT &= 0b10011011;
-            enable();
-            break;
-         case 'Z':
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            PORTA.OUT |= 0b10101000;
-            PORTA.OUT &= 0b10101011;
-            enable();
-            break;
-         case '[':
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            PORTA.OUT |= 0b10111000;
-            PORTA.OUT &= 0b10111011;
-            enable();
-            break;
-         case ']':
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            PORTA.OUT |= 0b11011000;
-            PORTA.OUT &= 0b11011011;
-            enable();
-            break;
-         case '^':
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            PORTA.OUT |= 0b11101000;
-            PORTA.OUT &= 0b11101011;
-            enable();
-            break;
-         case '_':
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            PORTA.OUT |= 0b11111000;
-            PORTA.OUT &= 0b11111011;
-            enable();
-            break;
-         case '`':
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            PORTA.OUT |= 0b00001000;
-            PORTA.OUT &= 0b00001011;
-            enable();
-            break;
-         case 'a':
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            PORTA.OUT |= 0b00011000;
-            PORTA.OUT &= 0b00011011;
-            enable();
-            break;
-         case 'b':
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            break;
-         case 'c':
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            break;
-         case 'd':
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            break;
-         case 'e':
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            break;
-         case 'f':
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            break;
-         case 'g':
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            break;
-         case 'h':
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            PORTA.OUT |= 0b10001000;
-            PORTA.OUT &= 0b10001011;
-            enable();
-            break;
-         case 'i':
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            PORTA.OUT |= 0b10011000;
-            PORTA.OUT &= 0b10011011;
-            enable();
-            break;
-         case 'j':
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            PORTA.OUT |= 0b10101000;
-            PORTA.OUT &= 0b10101011;
-            enable();
-            break;
-         case 'k':
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            PORTA.OUT |= 0b10111000;
-            PORTA.OUT &= 0b10111011;
-            enable();
-            break;
-         case 'l':
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            PORTA.OUT |= 0b11001000;
-            PORTA.OUT &= 0b11001011;
-            enable();
-            break;
-         case 'm':
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            PORTA.OUT |= 0b11011000;
-            PORTA.OUT &= 0b11011011;
-            enable();
-            break;
-         case 'n':
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            PORTA.OUT |= 0b11101000;
-            PORTA.OUT &= 0b11101011;
-            enable();
-            break;
-         case 'o':
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            PORTA.OUT |= 0b11111000;
-            PORTA.OUT &= 0b11111011;
-            enable();
-            break;
-         case 'p':
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            PORTA.OUT |= 0b00001000;
-            PORTA.OUT &= 0b00001011;
-            enable();
-            break;
-         case 'q':
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            PORTA.OUT |= 0b00011000;
-            PORTA.OUT &= 0b00011011;
-            enable();
-            break;
-         case 'r':
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            PORTA.OUT |= 0b00101000;
-            PORTA.OUT &= 0b00101011;
-            enable();
-            break;
-         case 's':
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            PORTA.OUT |= 0b00111000;
-            PORTA.OUT &= 0b00111011;
-            enable();
-            break;
-         case 't':
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            PORTA.OUT |= 0b01001000;
-            PORTA.OUT &= 0b01001011;
-            enable();
-            break;
-         case 'u':
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            PORTA.OUT |= 0b01011000;
-            PORTA.OUT &= 0b01011011;
-            enable();
-            break;
-         case 'v':
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            PORTA.OUT |= 0b01101000;
-            PORTA.OUT &= 0b01101011;
-            enable();
-            break;
-         case 'w':
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            break;
-         case 'x':
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            PORTA.OUT |= 0b10001000;
-            PORTA.OUT &= 0b10001011;
-            enable();
-            break;
-         case 'y':
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            PORTA.OUT |= 0b10011000;
-            PORTA.OUT &= 0b10011011;
-            enable();
-            break;
-         case 'z':
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            PORTA.OUT |= 0b10101000;
-            PORTA.OUT &= 0b10101011;
-            enable();
-            break;
-         case '{':
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            PORTA.OUT |= 0b10111000;
-            PORTA.OUT &= 0b10111011;
-            enable();
-            break;
-         case '|':
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            PORTA.OUT |= 0b11001000;
-            PORTA.OUT &= 0b11001011;
-            enable();
-            break;
-         case '}':
-            PORTA.OUT |= 0b01111000;
-            PORTA.OUT &= 0b01111011;
-            enable();
-            PORTA.OUT |= 0b11011000;
-            PORTA.OUT &= 0b11011011;
-            enable();
-            break;
+    PROBE_ENTER(PROBE_PRINT);
+    if(x >= 0 && x <= 9){
+        x += '0';   // raw digit values print as their character
     }
+    if(x >= ' ' && x <= 0xff){
+        lcdWrite(x, 0b00001000);    // control codes have no glyph
+    }
+    PROBE_EXIT(PROBE_PRINT);
 }              //prints input x to LCD
 void printStr(const char *str){
     for(int i=0; str[i] != '\0'; i++){
-        print(str[i]);
+        print((unsigned char)str[i]);
     }
 }   //prints a string str to LCD
-void delay(int i) {
-    int delay = 0;
-    while(delay < i){ //message displayed for 3 seconds
-        if(secondPassed()){
-            delay++;
+void printNum(unsigned long n){
+    char digits[10];
+    int i = 0;
+    do{
+        digits[i++] = n % 10;
+        n /= 10;
+    } while(n > 0);
+    while(i > 0){
+        print(digits[--i]);
+    }
+}   //prints the decimal value of n to LCD
+void frameClear(){
+    for(int row = 0; row < 2; row++){
+        for(int col = 0; col < 16; col++){
+            lcdFrame[row][col] = ' ';
+        }
+    }
+}               //blanks the frame, shown on the next frameFlush()
+void framePut(int row, int col, char c){
+    if(row >= 0 && row < 2 && col >= 0 && col < 16){
+        lcdFrame[row][col] = c;
+    }
+}               //puts character c in the frame at row, col
+void framePrint(int row, int col, const char *str){
+    for(int i = 0; str[i] != '\0'; i++){
+        framePut(row, col + i, str[i]);
+    }
+}               //puts string str in the frame starting at row, col
+void frameFlush(){
+    unsigned char written = 0;
+    for(int row = 0; row < 2; row++){
+        for(int col = 0; col < 16; col++){
+            if(lcdFrame[row][col] != lcdShadow[row][col]){
+                if(lcdAddr != row * 0x40 + col){
+                    setCursor(row, col); // one command instead of walking the cursor there
+                }
+                print((unsigned char)lcdFrame[row][col]);
+                written++;
+            }
         }
     }
+    trace(TRACE_FLUSH, written);
+}               //writes only the cells that differ from what the LCD shows
+void delay(int i) {
+    waitUntil(uptimeTicks() + i * 1024UL);
 }               // delay in seconds
+#ifdef LCD_REPORT_RATE
+void lcdReportRate(){
+    unsigned long start;
+    unsigned long cycles;
+    clearDisplay();
+    start = sessionActiveCycles();
+    for(int i = 0; i < 16; i++){
+        resetCursor();
+        printStr("0123456789abcdef");
+    }
+    cycles = sessionActiveCycles() - start;
+    clearDisplay();
+    printNum(256UL * cpuHz / (cycles ? cycles : 1));
+    printStr(" chars/s");
+    delay(3);
+}   //times 256 characters through printStr() on TCB1 and shows chars per second, the LCD waits spin so none of it sleeps
+#endif
 
 //Functions to do with AVR timer
+// Clock plan: MCLK always runs from OSCHF, undivided. Everything's constants are worked out for
+// CLOCK_SLOW (F_CPU), the core only goes to CLOCK_FAST for bursts of work in the main loop and
+// drops back before it sleeps. The fast clock is 4 * F_CPU so TCA0 can keep its rate one
+// prescaler step up (CLK_PER / 16, 64, 256 become / 64, 256, 1024).
+#define CLOCK_SLOW 0
+#define CLOCK_FAST 1
+
+#define TRACE_BAUD 115200
+#define USART_BAUD(hz) ((4 * (hz) + TRACE_BAUD / 2) / TRACE_BAUD)   // USART.BAUD, 64 * hz / (16 * baud)
+
+typedef struct {
+    unsigned long hz;
+    unsigned char oschf;        // CLKCTRL.OSCHFCTRLA, FRQSEL in bits 5-2
+    unsigned char tcaShift;     // TCA0 prescaler steps to add
+    unsigned char sampLen;      // ADC0.SAMPCTRL, keeps a button sample (four conversions) at about 1ms
+    unsigned int usartBaud;     // USART1.BAUD for TRACE_BAUD
+} clockPlan_t;
+
+const clockPlan_t clockPlan[] = {
+    {F_CPU,     0b00001100, 0, 0,  USART_BAUD(F_CPU)},      // OSCHF 4MHz, 4 x 15 ADC clocks at CLK_PER / 64
+    {4 * F_CPU, 0b00011100, 1, 45, USART_BAUD(4 * F_CPU)},  // OSCHF 16MHz, 4 x 60 ADC clocks at CLK_PER / 64
+};
+unsigned char clockState = CLOCK_SLOW;
+
 void initClock(){
     //32k oscillator always active
     CLKCTRL.OSC32KCTRLA |= 0b10000000;
-    //choose 32k oscillator
-    CLKCTRL.MCLKCTRLA |= 0b00000001;
+    //MCLK stays on OSCHF, clockSet() picks its frequency
     //select 1.024kHz
     RTC.CLKSEL |= 0b00000001;
-    //enable periodic interrupt
-    RTC.PITINTCTRL |= 0b00000001;
-    //select 1024 cycles and enable
-    RTC.PITCTRLA |= 0b01001001;
+    //count overflows, the counter is the low half of uptimeTicks()
+    RTC.INTCTRL |= 0b00000001;
+    //run the RTC counter at 1.024kHz, also in standby
+    RTC.CTRLA |= 0b10000001;
+    //count CPU cycles while awake, TCB1 is stopped whenever the core sleeps
+    TCB1.CCMP = 0xffff;
+    TCB1.INTCTRL = 0b00000001;
+    TCB1.CTRLA = 0b00000001;
 }                //Initializes clock. RUN ONLY ONCE
-int secondPassed(){
-    if(RTC.PITINTFLAGS){
-        RTC.PITINTFLAGS = 0b00000001;
-        return 1;
-        }
-    else{
-        return 0;
+volatile unsigned int rtcWraps = 0;         // RTC counter overflows (64s each), high half of uptimeTicks()
+volatile unsigned int activeWraps = 0;      // TCB1 wraps (65536 cycles each) while awake
+unsigned long sessionWakeups = 0;           // times the core woke up since resetSessionStats()
+
+void clockSet(unsigned char state){
+    unsigned char oschf = clockPlan[state].oschf;
+    if(state == clockState || traceBusy()){
+        return;     // a byte on USART1 would come out garbled if the clock changed under it
+    }
+    cli();
+    _PROTECTED_WRITE(CLKCTRL.OSCHFCTRLA, oschf);
+    while(!(CLKCTRL.MCLKSTATUS & 0b00000010)){}     // OSCHFS, running at the new frequency
+    clockState = state;
+    cpuHz = clockPlan[state].hz;
+    tcaShift = clockPlan[state].tcaShift;
+    tca_run();
+    ADC0.SAMPCTRL = clockPlan[state].sampLen;
+    USART1.BAUD = clockPlan[state].usartBaud;
+    sei();
+    lcdTiming();
+}               //Switches MCLK to state of the clock plan
+
+ISR(RTC_CNT_vect){
+    unsigned char flags = RTC.INTFLAGS;
+    RTC.INTFLAGS = flags;       // compare match only has to wake the core
+    if(flags & 0b00000001){
+        rtcWraps++;
+    }
+}
+ISR(TCB1_INT_vect){
+    TCB1.INTFLAGS = 0b00000001;
+    activeWraps++;
+}
+uint16_t rtcCount(){
+    unsigned char sreg = SREG;
+    uint16_t cnt;
+    cli();
+    cnt = RTC.CNT;
+    SREG = sreg;
+    return cnt;
+}                //Returns RTC.CNT read with interrupts disabled
+unsigned long uptimeTicks(){
+    unsigned long ticks;
+    unsigned int cnt;
+    cli();
+    cnt = RTC.CNT;
+    ticks = ((unsigned long)rtcWraps << 16) | cnt;
+    if((RTC.INTFLAGS & 0b00000001) && cnt < 0x8000){
+        ticks += 0x10000;           // overflowed after interrupts were disabled
     }
-}               //Returns 1 if a second has passed since it was last called
+    sei();
+    return ticks;
+}               //Returns the RTC ticks since initClock()
+unsigned long uptimeMs(){
+    unsigned long ticks = uptimeTicks();
+    return (ticks >> 7) * 125 + (((ticks & 127) * 125) >> 7);
+}               //Returns the milliseconds since initClock(), ticks * 1000 / 1024 without overflowing
+void wakeAfter(unsigned int ticks){
+    if(ticks < 3){
+        ticks = 3;      // CMP takes a couple of RTC cycles to sync, wake slightly late
+    }
+    if(ticks > 0x7fff){
+        ticks = 0x7fff;
+    }
+    unsigned char sreg = SREG;
+    while(RTC.STATUS & 0b00001000){}    // CMPBUSY
+    cli();
+    RTC.CMP = RTC.CNT + ticks;          // both through RTC.TEMP, no interrupt in between
+    SREG = sreg;
+    RTC.INTCTRL |= 0b00000010;          // wake on compare match
+}               //Arms the RTC compare ticks from now
+void waitUntil(unsigned long deadline){
+    long left;
+    while((left = deadline - uptimeTicks()) > 0){
+        wakeAfter(left > 0x7fff ? 0x7fff : left);
+        cli();
+        sleepUntilEvent();
+    }
+}               //Sleeps until uptimeTicks() reaches deadline
+void sleepUntilEvent(){
+    if(speaker_busy() || motor_busy() || buttonTracking() || traceBusy()){
+        SLPCTRL.CTRLA = 0b00000001; // idle, TCA0, the free-running ADC and USART1 need CLK_PER
+    } else {
+        SLPCTRL.CTRLA = 0b00000011; // standby, the RTC runs and wakes the ADC for its samples
+    }
+    TCB1.CTRLA = 0b00000000;        // stop counting active cycles
+    sei();
+    sleep_cpu();                    // sei lets one more instruction run, so no wakeup is missed
+    TCB1.CTRLA = 0b00000001;
+    SLPCTRL.CTRLA = 0b00000000;
+    sessionWakeups++;
+}               //Sleeps until the next interrupt
+void resetSessionStats(){
+    cli();
+    sessionWakeups = 0;
+    activeWraps = 0;
+    TCB1.CNT = 0;
+    TCB1.INTFLAGS = 0b00000001;
+    sei();
+#ifdef PROFILE
+    resetProbes();
+#endif
+}               //Starts counting wakeups and active cycles for a new session
+unsigned long sessionActiveCycles(){
+    unsigned long cycles;
+    cli();
+    cycles = ((unsigned long)activeWraps << 16) | TCB1.CNT;
+    if((TCB1.INTFLAGS & 0b00000001) && TCB1.CNT < 0x8000){
+        cycles += 0x10000;          // wrapped after interrupts were disabled
+    }
+    sei();
+    return cycles;
+}               //Returns the CPU cycles spent awake this session
+#ifdef PROFILE
+void probeExit(unsigned char id){
+    probe_t *p = &probes[id];
+    uint16_t cycles = TCB1.CNT - p->start;  // wraps like the counter
+    p->calls++;
+    p->total += cycles;
+    if(cycles < p->min){
+        p->min = cycles;
+    }
+    if(cycles > p->max){
+        p->max = cycles;
+    }
+}               //Counts one call of probe id
+void resetProbes(){
+    for(int i = 0; i <= PROBE_SELF; i++){
+        probes[i].calls = 0;
+        probes[i].total = 0;
+        probes[i].min = 0xffff;
+        probes[i].max = 0;
+    }
+    cli();
+    uint16_t start = TCB1.CNT;
+    PROBE_ENTER(PROBE_SELF);
+    PROBE_EXIT(PROBE_SELF);
+    probeCost = TCB1.CNT - start;
+    sei();
+}               //Zeroes every probe and measures what one costs
+#endif
 
 //Function for the buttons
+// Button codes: 1 select, 2 down, 3 right, 4 up, 5 left, 0 none.
+// Events in the queue are the button code for a press, or the code | 0b10000000 for its release
+// Every sample is four conversions added up by the ADC (SAMPNUM), shifted back to 12 bits
+#define BUTTON_RELEASED 0x030       // ladder reads at most this with no button down
+#define BUTTON_DEBOUNCE 8           // identical samples (~1ms each) before a change is accepted
+#define BUTTON_QUEUE_SIZE 8         // must be a power of 2
+#define BUTTON_ACC_SHIFT 2          // log2 of the conversions in a sample, ADC0.CTRLB SAMPNUM ACC4
+#define BUTTON_HYST 0x040           // a button keeps reading as itself this far past its thresholds
+#define LADDER_SIZE 5
+#define LADDER_GAP 0x100            // closest two calibrated levels may be, and left to BUTTON_RELEASED
+
+typedef struct {
+    unsigned int level;             // sample with only this button down
+    unsigned int top;               // highest sample that reads as it, halfway to the next level
+    unsigned char button;
+} ladder_t;
+
+ladder_t ladder[LADDER_SIZE] = {    // sorted by voltage, the levels are replaced by a saved calibration
+    {0x266, 0, 5},                  // left
+    {0x428, 0, 3},                  // right
+    {0x63d, 0, 4},                  // up
+    {0x9c2, 0, 2},                  // down
+    {0xf00, 0, 1},                  // select
+};
+
+volatile unsigned char buttonQueue[BUTTON_QUEUE_SIZE];
+volatile uint16_t buttonStamp[BUTTON_QUEUE_SIZE];  // RTC.CNT when the change was first sampled
+volatile unsigned char buttonHead = 0;
+volatile unsigned char buttonTail = 0;
+volatile unsigned char buttonState = 0;     // debounced button, 0 for none
+volatile unsigned char buttonSeen = 0;      // last classified sample
+volatile unsigned char buttonCount = 0;     // samples in a row equal to buttonSeen
+volatile uint16_t buttonSince = 0;          // RTC.CNT when buttonSeen first appeared
+volatile unsigned char buttonTracked = 0;   // 1 while the ADC is free-running to debounce a button
+volatile unsigned char buttonCalibrating = 0;   // 1 reads every press as select, the ladder is being learnt
+volatile unsigned long buttonHeldSum = 0;   // samples added up while the debounced button stays down
+volatile unsigned int buttonHeldCount = 0;
+unsigned int buttonLatencyMax = 0;          // longest press-to-read time in RTC ticks (1/1024s)
+
+void ladderThresholds(){
+    for(int i = 0; i < LADDER_SIZE - 1; i++){
+        ladder[i].top = (ladder[i].level + ladder[i + 1].level) / 2;
+    }
+    ladder[LADDER_SIZE - 1].top = 0xfff;
+}               // puts each threshold halfway between two levels, run after the levels change
+int ladderValid(const unsigned int *level){
+    if(level[0] < BUTTON_RELEASED + LADDER_GAP){
+        return 0;
+    }
+    for(int i = 1; i < LADDER_SIZE; i++){
+        if(level[i] < level[i - 1] + LADDER_GAP || level[i] > 0xfff){
+            return 0;
+        }
+    }
+    return 1;
+}               // returns 1 if LADDER_SIZE levels are in order and far enough apart to tell apart
+void buttonIdle(){
+    ADC0.CTRLA &= 0b11111101;       // FREERUN off, the conversion running finishes on its own
+    ADC0.INTCTRL = 0b00000010;      // WCMP only
+    ADC0.INTFLAGS = 0b00000011;
+    buttonTracked = 0;
+}               // goes back to one conversion per PIT event, only a press wakes the core
 void initButton(){
     
     PORTD.DIRCLR = 0b00000100;
@@ -1063,453 +979,1280 @@ void initButton(){
     // Set the ADC reference level to VDD.
     VREF.ADC0REF = 0b10000101;
     
-    // Enable the ADC interrupt.
-    ADC0.INTCTRL = 0b00000001;
-    
     // Select PD2 (AIN2) as the ADC input.
     ADC0.MUXPOS = 0x02;
 
-    // Select minimum clock divide.
-    ADC0.CTRLC = 0x00; 
+    // CLK_ADC = CLK_PER / 64, four conversions a result, about one result per millisecond at 4MHz
+    ADC0.CTRLC = 0x0A; 
+    ADC0.CTRLB = 0x02;
     
-    // Select single ended mode, 12 bit resolution and free-running modes.
-    ADC0.CTRLA = 0b00000011;
+    // Window comparator fires when a result leaves the released window (RES > WINHT)
+    ADC0.WINHT = BUTTON_RELEASED << BUTTON_ACC_SHIFT;
+    ADC0.CTRLE = 0b00000010;
     
-    // Start conversion.
-    ADC0.COMMAND = 0x01; 
-}               // initialize the buttons
-
-int selectButton(){
-    if(ADC0.INTFLAGS = 0b0000001){
-        
-        if(ADC0.RES > 0xe66){
-            return 1;
-        }
-        else{
-            return 0;
+    // PIT prescaler runs from the 1.024kHz RTC clock, its CLK_RTC / 64 output (16Hz)
+    // goes on event channel 1 and starts a conversion on every rising edge.
+    // The PIT interrupt itself stays off
+    while(RTC.PITSTATUS & 0b00000001){}     // CTRLBUSY
+    RTC.PITCTRLA = 0b00101001;              // PERIOD CYC64, PITEN
+    EVSYS.CHANNEL1 = 0x0B;                  // RTC_PIT_DIV64
+    EVSYS.USERADC0START = 0x02;             // channel 1
+    
+    // Select single ended mode and 12 bit resolution, keep converting in standby.
+    ADC0.CTRLA = 0b10000001;
+    ladderThresholds();
+    buttonIdle();
+}               // initialize the buttons, RTC has to be running
+void buttonsWatch(unsigned char on){
+    ADC0.EVCTRL = on;               // STARTEI, PIT events start conversions
+}               // starts or stops sampling the buttons
+int buttonTracking(){
+    return buttonTracked;
+}               // returns 1 while the ADC is free-running
+unsigned char classifyLadder(unsigned int res, unsigned char held){
+    unsigned char i = 0;
+    if(res <= BUTTON_RELEASED){
+        return 0;
+    }
+    if(buttonCalibrating){
+        return held ? held : 1;     // whatever the level, one press stays one button
+    }
+    while(i < LADDER_SIZE - 1 && res > ladder[i].top){
+        i++;
+    }
+    if(held && ladder[i].button != held){
+        for(unsigned char j = 0; j < LADDER_SIZE; j++){
+            unsigned int low = j ? ladder[j - 1].top : BUTTON_RELEASED;
+            if(ladder[j].button == held && res + BUTTON_HYST > low && res < ladder[j].top + BUTTON_HYST){
+                return held;    // not far enough past its own thresholds yet
+            }
         }
     }
-}               //returns 1 when the select button is pressed, 0 otherwise
-int leftButton() {
-    if(ADC0.INTFLAGS = 0b0000001){
-        if(ADC0.RES > 0x199 & ADC0.RES < 0x333){
-            //while(ADC0.RES > 0x320 & ADC0.RES < 0x352){}
-            return 1;
+    return ladder[i].button;
+}               // returns the button for a sample, held is the button the last sample read as
+void pushButtonEvent(unsigned char event, uint16_t stamp){
+    unsigned char next = (buttonTail + 1) & (BUTTON_QUEUE_SIZE - 1);
+    if(next == buttonHead){
+        return;     // queue full, the UI is not reading, drop the event
+    }
+    buttonQueue[buttonTail] = event;
+    buttonStamp[buttonTail] = stamp;
+    buttonTail = next;
+}               // adds an event to the queue, only called from the ADC interrupt
+ISR(ADC0_WCMP_vect){
+    ADC0.INTFLAGS = 0b00000011;     // the RESRDY of the same result too, it is not read
+    buttonSeen = 0;
+    buttonCount = 0;                // back to buttonIdle() after BUTTON_DEBOUNCE released samples
+    buttonTracked = 1;
+    ADC0.INTCTRL = 0b00000001;      // RESRDY only
+    ADC0.CTRLA |= 0b00000010;       // FREERUN until the button is let go
+    ADC0.COMMAND = 0x01;
+}               // a sample left the released window, debounce it at the full rate
+ISR(ADC0_RESRDY_vect){
+    unsigned int res = ADC0.RES >> BUTTON_ACC_SHIFT;    // reading RES clears the flag
+    unsigned char level = classifyLadder(res, buttonSeen);
+    if(level && level == buttonState && buttonHeldCount < 1024){
+        buttonHeldSum += res;
+        buttonHeldCount++;
+    }
+    if(level != buttonSeen){
+        buttonSeen = level;
+        buttonCount = 1;
+        buttonSince = RTC.CNT;
+        return;
+    }
+    if(buttonCount < BUTTON_DEBOUNCE){
+        buttonCount++;
+        if(buttonCount == BUTTON_DEBOUNCE && level != buttonState){
+            if(buttonState){
+                pushButtonEvent(buttonState | 0b10000000, buttonSince);
+            }
+            if(level){
+                pushButtonEvent(level, buttonSince);
+                buttonHeldSum = 0;
+                buttonHeldCount = 0;
+            }
+            buttonState = level;
         }
-        else{
-            return 0;
+        if(buttonCount == BUTTON_DEBOUNCE && !level){
+            buttonIdle();   // released for good, the window comparator takes over again
         }
     }
-}                 //returns 1 when the left button is pressed, 0 otherwise
-int rightButton(){
-    if(ADC0.INTFLAGS = 0b0000001){    
-        if(ADC0.RES > 0x385 & ADC0.RES < 0x4cc){
-            //while(ADC0.RES > 0x659 & ADC0.RES < 0x68b){}
-            return 1;
-        }
-        else{
-            return 0;
+}
+int buttonEvent(){
+    unsigned char event;
+    uint16_t latency;
+    cli();
+    if(buttonHead == buttonTail){
+        sei();
+        return 0;
+    }
+    event = buttonQueue[buttonHead];
+    latency = RTC.CNT - buttonStamp[buttonHead];
+    buttonHead = (buttonHead + 1) & (BUTTON_QUEUE_SIZE - 1);
+    sei();
+    if(!(event & 0b10000000) && latency > buttonLatencyMax){
+        buttonLatencyMax = latency;
+    }
+    return event;
+}               // returns the next press or release event, 0 if there is none. Never waits
+void buttonFlush(){
+    cli();
+    buttonHead = buttonTail;
+    sei();
+}               // throws away events nobody read
+#ifdef TRACE
+//Functions for the trace channel
+// Events wait in traceQueue until the USART1 data register empty interrupt sends them, one
+// byte per interrupt. Once the queue is empty the transmit complete interrupt says when the
+// last byte is out, until then traceBusy() keeps the clock and the sleep mode steady.
+#define TRACE_QUEUE_SIZE 64     // bytes, 16 events, must be a power of 2
+
+volatile unsigned char traceQueue[TRACE_QUEUE_SIZE];
+volatile unsigned char traceHead = 0;
+volatile unsigned char traceTail = 0;
+volatile unsigned char traceSending = 0;    // 1 from the first queued byte until the last is out
+unsigned int traceDropped = 0;              // events dropped since the last TRACE_DROP
+
+void initTrace(){
+    PORTC.DIRSET = 0b00000001;      // TXD on PC0, USART1's default pins
+    USART1.BAUD = clockPlan[clockState].usartBaud;
+    USART1.CTRLC = 0b00000011;      // asynchronous, 8 data bits, no parity, 1 stop bit
+    USART1.CTRLB = 0b01000000;      // transmitter on
+}               // starts USART1 for the trace
+void tracePut(unsigned char type, unsigned int stamp, unsigned char arg){
+    traceQueue[traceTail] = type;
+    traceQueue[(traceTail + 1) & (TRACE_QUEUE_SIZE - 1)] = stamp;
+    traceQueue[(traceTail + 2) & (TRACE_QUEUE_SIZE - 1)] = stamp >> 8;
+    traceQueue[(traceTail + 3) & (TRACE_QUEUE_SIZE - 1)] = arg;
+    traceTail = (traceTail + 4) & (TRACE_QUEUE_SIZE - 1);
+}               // adds one event to the queue, call with interrupts disabled and room for it
+void traceEvent(unsigned char type, unsigned int stamp, unsigned char arg){
+    cli();
+    unsigned char room = (traceHead - traceTail - 1) & (TRACE_QUEUE_SIZE - 1);
+    if(room < (traceDropped ? 8 : 4)){
+        if(traceDropped < 0xffff){
+            traceDropped++;
         }
+        sei();
+        return;     // queue full, the event is lost but counted
+    }
+    if(traceDropped){
+        tracePut(TRACE_DROP, stamp, traceDropped > 255 ? 255 : traceDropped);
+        traceDropped = 0;
+    }
+    tracePut(type, stamp, arg);
+    traceSending = 1;
+    USART1.CTRLA = 0b00100000;      // DREIE, the interrupt takes it from here
+    sei();
+}               // queues an event for USART1, never waits
+void trace(unsigned char type, unsigned char arg){
+    traceEvent(type, rtcCount(), arg);
+}               // queues an event stamped with RTC.CNT
+int traceBusy(){
+    return traceSending;
+}               // returns 1 until the last queued byte has been sent
+ISR(USART1_DRE_vect){
+    USART1.STATUS = 0b01000000;     // clear TXCIF, it comes back once this byte is out with none after it
+    USART1.TXDATAL = traceQueue[traceHead];
+    traceHead = (traceHead + 1) & (TRACE_QUEUE_SIZE - 1);
+    if(traceHead == traceTail){
+        USART1.CTRLA = 0b01000000;  // queue empty, TXCIE waits for the last byte
     }
-}                //returns 1 when the right button is pressed, 0 otherwise
-int upButton(){
-    if(ADC0.INTFLAGS = 0b0000001){
-        if(ADC0.RES > 0x51e & ADC0.RES < 0x75c){
-            //while(ADC0.RES > 0x979 & ADC0.RES < 0x9ab){}
-            return 1;
+}
+ISR(USART1_TXC_vect){
+    USART1.STATUS = 0b01000000;
+    USART1.CTRLA = 0b00000000;
+    traceSending = 0;
+}
+#endif
+
+//Functions for the scheduler
+// Tasks run to completion: each call does a short piece of work and returns. Timed tasks sit
+// in a small table and are run from the main loop once RTC.CNT reaches their due time
+#define TASK_SLOTS 6
+
+typedef struct {
+    void (*run)(void);      // 0 for a free slot
+    uint16_t due;           // RTC.CNT value the task is due at, wraps with it
+} task_t;
+
+task_t tasks[TASK_SLOTS];
+
+void schedule(void (*run)(void), unsigned int ticks){
+    int slot = -1;
+    for(int i = 0; i < TASK_SLOTS; i++){
+        if(tasks[i].run == run){
+            slot = i;
+            break;
         }
-        else{
-            return 0;
+        if(tasks[i].run == 0 && slot < 0){
+            slot = i;
         }
     }
-}                   //returns 1 when the up button is pressed, 0 otherwise
-int downButton(){
-    if(ADC0.INTFLAGS = 0b0000001){
-        if(ADC0.RES > 0x8f5 & ADC0.RES < 0xa8f){
-            //while(ADC0.RES > 0xcb2 & ADC0.RES < 0xce4){}
-            return 1;
+    if(slot < 0){
+        return;     // table full, TASK_SLOTS is too small
+    }
+    tasks[slot].due = rtcCount() + ticks;
+    tasks[slot].run = run;
+}               // runs run() once, ticks / 1024 seconds from now. Scheduling it again moves it
+void scheduleAt(void (*run)(void), unsigned long deadline){
+    long left = deadline - uptimeTicks();
+    schedule(run, left > 0 ? left : 0);
+}               // runs run() once uptimeTicks() reaches deadline
+void cancelTask(void (*run)(void)){
+    for(int i = 0; i < TASK_SLOTS; i++){
+        if(tasks[i].run == run){
+            tasks[i].run = 0;
         }
-        else{
-            return 0;
+    }
+}               // forgets a task that has not run yet
+void runDueTasks(){
+    for(int i = 0; i < TASK_SLOTS; i++){
+        void (*run)(void) = tasks[i].run;
+        if(run && (int16_t)(rtcCount() - tasks[i].due) >= 0){
+            tasks[i].run = 0;   // cleared first so the task can schedule itself again
+            clockSet(CLOCK_FAST);
+            run();
         }
     }
-}                 //returns 1 when the down button is pressed, 0 otherwise
-int user_input(){
-    
-    int input;
-    
-    while(ADC0.RES <= 0x030){}
-        
-    if (selectButton()){
-        input = 1;
-    } else if (downButton()){
-        input = 2;  
-    } else if (rightButton()){
-        input = 3;
-    } else if (upButton()){
-        input = 4; 
-    } else if(leftButton()){
-        input = 5;  
+}               // runs every task whose time has come
+void idle(){
+    int armed = 0;
+    unsigned int wait = 0xffff;
+    uint16_t due = 0;
+    uint16_t now = rtcCount();
+    for(int i = 0; i < TASK_SLOTS; i++){
+        if(tasks[i].run){
+            int16_t left = tasks[i].due - now;
+            if(left <= 0){
+                return;     // due now
+            }
+            if((unsigned int)left < wait){
+                wait = left;
+                due = tasks[i].due;
+                armed = 1;
+            }
+        }
+    }
+    clockSet(CLOCK_SLOW);   // sets the I bit again, so it goes before cli()
+    cli();                  // a compare match from here on stays pending and wakes the sleep at once
+    if(armed){
+        int16_t left = due - rtcCount();
+        if(left <= 0){
+            sei();
+            return;     // came due while the clock was switching
+        }
+        wakeAfter(left);
     } else {
-        input = 0;
+        RTC.INTCTRL &= 0b11111101;
     }
-        
-    while(ADC0.RES >= 0x030){}
-    
-    return input;
+    if(buttonHead != buttonTail){
+        sei();
+        return;     // something came in while the compare was being set up
+    }
+    sleepUntilEvent();
+}               // sleeps until the next button event or timed task
+
+//Functions for the LEDs
+// The LEDs are on PA1-0 next to the LCD, low turns them on
+#define LED_STUDY_bm 0b00000010 // LED_1 on PA1
+#define LED_BREAK_bm 0b00000001 // LED_2 on PA0
+void studyLed(){
+    PORTA.OUTSET = LED_BREAK_bm; // Turn off LED_2
+    PORTA.OUTCLR = LED_STUDY_bm; // Turn on LED_1 (Study LED)
+}
+void breakLed(){
+    PORTA.OUTSET = LED_STUDY_bm; // Turn off LED_1
+    PORTA.OUTCLR = LED_BREAK_bm; // Turn on LED_2 (Break LED)
 }
+void ledsOff(){
+    PORTA.OUTSET = LED_STUDY_bm | LED_BREAK_bm;
+}
+int blinksLeft = 0;
+void ledBlink(){
+    PORTA.OUTTGL = LED_STUDY_bm | LED_BREAK_bm; // swap which LED is on
+    blinksLeft--;
+    if(blinksLeft > 0){
+        schedule(ledBlink, 1024);
+    }
+}               // timed task, swaps the LEDs once a second while blinksLeft > 0
 
-//Functions to do with code logic
-void welcome(){
-    intro_song(); // Play the song
-    motor_buzz(); // Motor Vibration
-    clearDisplay();
-    printStr("Welcome to:");
-    resetCursor();
-    cursorRow();
-    printStr("Study Buddy");
-    delay(3);
-    clearDisplay();
-    printStr("Press select");
-    resetCursor();
-    cursorRow();
-    printStr("to start:");
-    while(user_input() != 1){}
-    //delay(2);
-}                  // welcome message
-int getStudyInput(){
-    int leftNum = 5;
-    int rightNum = 5;
-    clearDisplay();
-    printStr("Study Time: ");
-    print(leftNum);
-    print(rightNum);
-    print('m');
-    cursorLeft(3); //go back to leftmost number
-    int right = 0; //0 means not on this number
-    int left = 1;  //1 means we are on this number
-    int input;
-    
-    while(1){
-        
-        input = user_input();
-        
-        if(input == 5 && left == 0){
-            //printStr("1");
-            //delay(1);
-            left = 1;
-            right = 0;
-            cursorLeft(1);
+//Functions for the number spinner
+// Only one spinner is on the screen at a time. The number is kept as its digits, most
+// significant first, so turning a digit needs no division.
+#define SPIN_MAX_DIGITS 4
+#define SPIN_HOLD 512           // RTC ticks a button is held before it repeats (0.5s)
+#define SPIN_REPEAT 256         // first repeat interval in RTC ticks, shrinks by a quarter each repeat
+#define SPIN_REPEAT_MIN 32      // fastest repeat interval, about 30 steps a second
+
+typedef struct {
+    unsigned char row, col;     // LCD position of the first digit
+    unsigned char digits;       // number of digits, 1 to SPIN_MAX_DIGITS
+    unsigned char pos;          // digit the cursor is on, 0 is the first
+    int min, max;               // limits of the value
+    unsigned char digit[SPIN_MAX_DIGITS];
+} spinner_t;
+
+spinner_t spinner;
+unsigned char spinHeld = 0;     // up or down while it auto-repeats, 0 otherwise
+unsigned int spinInterval;      // RTC ticks until the next repeat
+
+void spinnerRepeat();
+
+int spinnerValue(){
+    int value = 0;
+    for(int i = 0; i < spinner.digits; i++){
+        value = value * 10 + spinner.digit[i];
+    }
+    return value;
+}               // returns the number the spinner shows
+void spinnerDigit(int i){
+    setCursor(spinner.row, spinner.col + i);
+    print(spinner.digit[i]);
+    cursorLeft(1);
+}               // prints digit i and leaves the cursor on it
+void spinnerOpen(int row, int col, int digits, int min, int max, int value){
+    static const int place[SPIN_MAX_DIGITS] = {1000, 100, 10, 1};
+    cancelTask(spinnerRepeat);
+    spinHeld = 0;
+    spinner.row = row;
+    spinner.col = col;
+    spinner.digits = digits;
+    spinner.pos = 0;
+    spinner.min = min;
+    spinner.max = max;
+    for(int i = 0; i < digits; i++){
+        unsigned char d = 0;
+        while(value >= place[SPIN_MAX_DIGITS - digits + i]){
+            value -= place[SPIN_MAX_DIGITS - digits + i];
+            d++;
         }
-        else if (input == 3 && right == 0){
-            //printStr("2");
-            //delay(1);
-            right = 1;
-            left = 0;
-            cursorRight(1);
+        spinner.digit[i] = d;
+    }
+    for(int i = digits - 1; i >= 0; i--){
+        spinnerDigit(i);     // right to left so the cursor ends on the first digit
+    }
+}               // shows a spinner for value (min <= value <= max) at row, col
+void spinnerTurn(int up){
+    unsigned char *d = &spinner.digit[spinner.pos];
+    for(int i = 0; i < 10; i++){
+        if(up){
+            *d = (*d == 9) ? 0 : *d + 1;
+        } else {
+            *d = (*d == 0) ? 9 : *d - 1;
         }
-        
-        if(left == 1 && input == 4){
-            //printStr("3");
-            //delay(1);
-            leftNum++;
-            if(leftNum > 9){
-                leftNum = 0;
-            }
-            print(leftNum);
-            cursorLeft(1);
-            //delay(1);
+        int value = spinnerValue();
+        if(value >= spinner.min && value <= spinner.max){
+            break;  // ten turns at most, that is back where it started
         }
-        else if(left == 1 && input == 2){
-            //printStr("4");
-            //delay(1);
-            leftNum--;
-            if(leftNum < 0){
-                leftNum = 9;
-            }
-            print(leftNum);
-            cursorLeft(1);
-            //delay(1);
+    }
+    spinnerDigit(spinner.pos);
+}               // turns the digit under the cursor one step up or down, skipping values out of range
+void spinnerRepeat(){
+    if(buttonState != spinHeld){
+        spinHeld = 0;
+        return;     // let go, the release event is still in the queue
+    }
+    spinnerTurn(spinHeld == 4);
+    spinInterval -= spinInterval >> 2;
+    if(spinInterval < SPIN_REPEAT_MIN){
+        spinInterval = SPIN_REPEAT_MIN;
+    }
+    schedule(spinnerRepeat, spinInterval);
+}               // timed task, turns the digit again while up or down is held
+int spinnerKey(int event){
+    if(event & 0b10000000){
+        if((event & 0b01111111) == spinHeld){
+            cancelTask(spinnerRepeat);
+            spinHeld = 0;
         }
-        
-        if(right == 1 && input == 4){
-            //printStr("5");
-            //delay(1);
-            rightNum++;
-            if(rightNum > 9){
-                rightNum = 0;
-            }
-            print(rightNum);
-            cursorLeft(1);
-            //delay(1);
+        return 0;
+    }
+    if(event == 5 && spinner.pos > 0){
+        spinner.pos--;
+        cursorLeft(1);
+    }
+    else if(event == 3 && spinner.pos < spinner.digits - 1){
+        spinner.pos++;
+        cursorRight(1);
+    }
+    else if(event == 4 || event == 2){
+        spinnerTurn(event == 4);
+        spinHeld = event;
+        spinInterval = SPIN_REPEAT;
+        schedule(spinnerRepeat, SPIN_HOLD);
+    }
+    return event == 1;
+}               // handles a press or release in the spinner, returns 1 on select
+
+//Functions for the EEPROM
+// The EEPROM holds two rings of records: the saved settings in its first SETTINGS_BYTES and the
+// session history after them. The last bytes of the settings area hold the button calibration.
+// A record ends in a CRC-8 of the bytes before it, written last,
+// so a write cut short by a reset leaves a record that fails its check and is skipped.
+#define EEPROM_CMD_NONE   0x00  // NVMCTRL.CTRLA: no command
+#define EEPROM_CMD_EEERWR 0x13  // NVMCTRL.CTRLA: every EEPROM byte written is erased and written
+
+volatile unsigned char *const eeprom = (volatile unsigned char *)EEPROM_START;
+
+unsigned char crc8(const void *data, int n){
+    const unsigned char *p = data;
+    unsigned char crc = 0;
+    for(int i = 0; i < n; i++){
+        crc ^= p[i];
+        for(int bit = 0; bit < 8; bit++){
+            crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
         }
-        else if(right == 1 && input == 2){
-            //printStr("6");
-            //delay(1);
-            rightNum--;
-            if(rightNum < 0){
-                rightNum = 9;
-            }
-            print(rightNum);
-            cursorLeft(1);
-            //delay(1);
-        } else if(input == 1){
-            //printStr("7");
-            //delay(1);
-            break;
+    }
+    return crc;
+}               // returns the CRC-8 (polynomial x^8 + x^2 + x + 1) of n bytes
+void eepromRead(int addr, void *data, int n){
+    unsigned char *to = data;
+    for(int i = 0; i < n; i++){
+        to[i] = eeprom[addr + i];
+    }
+}               // copies n bytes out of EEPROM, it is mapped in data space so this is a plain read
+void eepromWrite(int addr, const void *data, int n){
+    const unsigned char *from = data;
+    _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, EEPROM_CMD_EEERWR);
+    for(int i = 0; i < n; i++){
+        if(eeprom[addr + i] != from[i]){
+            eeprom[addr + i] = from[i];
+            while(NVMCTRL.STATUS & 0b00000010); // EEBUSY, one byte at a time
         }
-        
     }
-    
-    //delay(1);
-    return leftNum * 10 + rightNum;
-}             //returns the study time in minutes
-int getBreakInput(){
-    int leftNum = 5;
-    int rightNum = 5;
-    clearDisplay();
-    printStr("Break Time: ");
-    print(leftNum);
-    print(rightNum);
-    print('m');
-    cursorLeft(3); //go back to leftmost number
-    int right = 0;
-    int left = 1;
-    int input;
-    
-    while(1){
-        
-        input = user_input();
-        
-        if(input == 5 && left == 0){
-            left = 1;
-            right = 0;
-            cursorLeft(1);
+    _PROTECTED_WRITE_SPM(NVMCTRL.CTRLA, EEPROM_CMD_NONE);
+}               // writes n bytes to EEPROM in order, bytes that already hold their value are not worn
+
+//Functions for the saved settings
+// Each save goes to the slot after the newest one, round the settings area, so a byte is only
+// rewritten once every SETTINGS_SLOTS saves, and nothing is written when the values did not
+// change. The good record with the highest seq is the newest.
+typedef struct {
+    uint16_t seq;               // save count, wraps
+    unsigned char study;        // minutes, 1 to 99
+    unsigned char rest;         // break minutes, 1 to 99
+    unsigned char rotations;    // 1 to 9
+    unsigned char check;        // CRC-8 of the bytes before it
+} settings_t;
+
+typedef struct {
+    uint16_t level[LADDER_SIZE];    // ladder[].level, left to select
+    unsigned char check;            // CRC-8 of level[]
+} calibration_t;
+
+#define SETTINGS_BYTES 128
+#define CALIBRATION_START (SETTINGS_BYTES - sizeof(calibration_t))
+#define SETTINGS_SLOTS ((int)(CALIBRATION_START / sizeof(settings_t)))   // int, slot numbers use -1 for none
+
+int settingsSlot = -1;          // slot of the newest good record, -1 for none
+uint16_t settingsSeq;           // its seq
+
+int userStudy = 55;             // chosen study time in minutes, 1 to 99
+int userBreak = 55;             // chosen break time in minutes, 1 to 99
+int userRotations = 1;          // chosen number of rotations, 1 to 9
+
+int settingsLoad(){
+    settings_t r;
+    settingsSlot = -1;
+    for(int slot = 0; slot < SETTINGS_SLOTS; slot++){
+        eepromRead(slot * sizeof(settings_t), &r, sizeof(r));
+        if(r.check != crc8(&r, sizeof(r) - 1) || r.study < 1 || r.study > 99 || r.rest < 1 || r.rest > 99
+           || r.rotations < 1 || r.rotations > 9){
+            continue;   // erased, torn or never written
         }
-        else if (input == 3 && right == 0){
-            right = 1;
-            left = 0;
-            cursorRight(1);
+        if(settingsSlot < 0 || (int16_t)(r.seq - settingsSeq) > 0){
+            settingsSlot = slot;
+            settingsSeq = r.seq;
+            userStudy = r.study;
+            userBreak = r.rest;
+            userRotations = r.rotations;
         }
-        
-        if(left == 1 && input == 4){
-            leftNum++;
-            if(leftNum > 9){
-                leftNum = 0;
-            }
-            print(leftNum);
-            cursorLeft(1);
-            //delay(1);
+    }
+    return settingsSlot >= 0;
+}               // loads the newest good record, returns 0 if there is none
+void settingsSave(){
+    settings_t r;
+    if(settingsSlot >= 0){
+        eepromRead(settingsSlot * sizeof(settings_t), &r, sizeof(r));
+        if(r.study == userStudy && r.rest == userBreak && r.rotations == userRotations){
+            return;     // same as the newest record, saves a write
         }
-        else if(left == 1 && input == 2){
-            leftNum--;
-            if(leftNum < 0){
-                leftNum = 9;
-            }
-            print(leftNum);
-            cursorLeft(1);
-            //delay(1);
+    }
+    r.seq = settingsSeq + 1;
+    r.study = userStudy;
+    r.rest = userBreak;
+    r.rotations = userRotations;
+    r.check = crc8(&r, sizeof(r) - 1);
+    int slot = settingsSlot + 1;
+    if(slot >= SETTINGS_SLOTS){
+        slot = 0;
+    }
+    eepromWrite(slot * sizeof(settings_t), &r, sizeof(r));
+    settingsSlot = slot;
+    settingsSeq = r.seq;
+}               // writes the settings to the next slot unless the newest record already holds them
+int calibrationLoad(){
+    calibration_t r;
+    unsigned int level[LADDER_SIZE];
+    eepromRead(CALIBRATION_START, &r, sizeof(r));
+    for(int i = 0; i < LADDER_SIZE; i++){
+        level[i] = r.level[i];
+    }
+    if(r.check != crc8(r.level, sizeof(r.level)) || !ladderValid(level)){
+        return 0;   // never calibrated, the default levels stay
+    }
+    for(int i = 0; i < LADDER_SIZE; i++){
+        ladder[i].level = level[i];
+    }
+    ladderThresholds();
+    return 1;
+}               // loads the saved button levels, returns 0 if there are none
+void calibrationSave(){
+    calibration_t r;
+    for(int i = 0; i < LADDER_SIZE; i++){
+        r.level[i] = ladder[i].level;
+    }
+    r.check = crc8(r.level, sizeof(r.level));
+    eepromWrite(CALIBRATION_START, &r, sizeof(r));
+}               // saves the button levels in ladder[]
+
+//Functions for the session history
+// Every session gets a record in a ring after the settings. It is appended as open when the
+// session starts, updated after each study phase and closed at the closing message, so a
+// session cut short by a reset or power loss stays in the log as open (aborted).
+// Records are written to consecutive slots with consecutive seq, so the newest one is the last
+// slot whose seq is the first slot's plus its index, found by a binary search. Each record
+// carries the totals up to and including its session, so nothing else is read at boot.
+typedef struct {
+    uint32_t started;           // uptime in seconds when the session started
+    uint32_t focusTotal;        // study minutes completed in every logged session up to this one
+    uint16_t seq;               // session count, wraps
+    unsigned char study;        // minutes
+    unsigned char rest;         // break minutes
+    unsigned char rotations;    // rotations chosen
+    unsigned char done;         // study phases completed
+    unsigned char open;         // 1 until the closing message, still 1 if the session was cut short
+    unsigned char check;        // CRC-8 of the bytes before it
+} history_t;
+
+#define HISTORY_START SETTINGS_BYTES
+#define HISTORY_SLOTS ((int)((EEPROM_SIZE - HISTORY_START) / sizeof(history_t)))
+
+history_t history;              // record of the current or last session, history.seq = 0 for none
+int historySlot = -1;           // slot history is in, -1 for none
+
+int historyRead(int slot, history_t *r){
+    eepromRead(HISTORY_START + slot * sizeof(history_t), r, sizeof(history_t));
+    return r->check == crc8(r, sizeof(history_t) - 1);
+}               // copies the record in slot out of EEPROM, returns 0 if it fails its check
+int historyFollows(int slot, uint16_t first){
+    history_t r;
+    return historyRead(slot, &r) && r.seq == (uint16_t)(first + slot);
+}               // returns 1 if slot holds a good record numbered first + slot
+void historyLoad(){
+    history_t r;
+    int lo = 0;
+    int hi = HISTORY_SLOTS - 1;
+    historySlot = -1;
+    history.seq = 0;
+    history.focusTotal = 0;
+    if(!historyRead(0, &r)){
+        if(historyRead(HISTORY_SLOTS - 1, &r)){
+            historySlot = HISTORY_SLOTS - 1;    // slot 0 was being rewritten when the power went
+            history = r;
         }
-        
-        if(right == 1 && input == 4){
-            rightNum++;
-            if(rightNum > 9){
-                rightNum = 0;
-            }
-            print(rightNum);
-            cursorLeft(1);
-            //delay(1);
+        return;
+    }
+    while(lo < hi){
+        int mid = (lo + hi + 1) >> 1;
+        if(historyFollows(mid, r.seq)){
+            lo = mid;
+        } else {
+            hi = mid - 1;
         }
-        else if(right == 1 && input == 2){
-            rightNum--;
-            if(rightNum < 0){
-                rightNum = 9;
-            }
-            print(rightNum);
-            cursorLeft(1);
-            //delay(1);
-        } else if(input == 1){
-            break;
+    }
+    historySlot = lo;
+    historyRead(lo, &history);
+}               // finds the newest record with a binary search, about log2(HISTORY_SLOTS) reads
+void historyWrite(){
+    history.check = crc8(&history, sizeof(history_t) - 1);
+    eepromWrite(HISTORY_START + historySlot * sizeof(history_t), &history, sizeof(history_t));
+}               // writes history back to its slot, only the bytes that changed
+void historyStart(){
+    history.started = uptimeTicks() >> 10;
+    history.seq++;
+    history.study = userStudy;
+    history.rest = userBreak;
+    history.rotations = userRotations;
+    history.done = 0;
+    history.open = 1;
+    historySlot++;
+    if(historySlot >= HISTORY_SLOTS){
+        historySlot = 0;
+    }
+    historyWrite();
+}               // appends an open record for the session that is starting, focusTotal carries over
+void historyStudyDone(){
+    history.done++;
+    history.focusTotal += history.study;
+    historyWrite();
+}               // counts a completed study phase in the current record
+void historyClose(){
+    history.open = 0;
+    historyWrite();
+}               // marks the current record as completed
+
+//Functions to do with code logic
+// Session states. main() hands every button press and timeout to the current state
+#define STATE_WELCOME   0   // banner while the intro song plays
+#define STATE_PROMPT    1   // waits for select
+#define STATE_STUDY_IN  2   // study time editor
+#define STATE_BREAK_IN  3   // break time editor
+#define STATE_ROTS_IN   4   // rotations editor
+#define STATE_CONFIRM   5   // shows the chosen values
+#define STATE_STUDY     6   // study countdown
+#define STATE_BREAK     7   // break countdown
+#define STATE_SWITCH    8   // LEDs blink between two phases
+#define STATE_CLOSING   9   // "All Done!"
+#define STATE_CALIBRATE 10  // learns the button levels, left on the prompt
+
+// The countdown is kept as packed BCD hh:mm:ss, two decimal digits a byte, so it counts down and
+// is shown without any division (the AVR has no divider, every / and % is a library call)
+typedef struct {
+    unsigned char bcd[3];   // hours, minutes, seconds, 0x00 to 0x99:0x59:0x59
+} countdown_t;
+
+int state;                  // current session state
+int rotsLeft;               // rotations left, counting the current one
+countdown_t countdown;      // time left on the countdown screen
+const char *timerLabel;     // label of the countdown screen
+unsigned long tickDeadline; // uptimeTicks() the countdown shows its next second at
+unsigned long phaseDeadline; // uptimeTicks() the current phase or switch screen ends at
+int switchFrom;             // STATE_STUDY or STATE_BREAK, the phase that just ended
+int closingStep;            // screen the closing message is on
+int calibrateStep;          // ladder[] entry being learnt
+int calibratePressed;       // 1 once the button for calibrateStep went down
+unsigned int calibrateLevel[LADDER_SIZE];
+
+void sessionEnter(int next);
+void sessionTimeout();
+void timerTick();
+
+unsigned char toBcd(unsigned char n){
+    unsigned char tens = 0;
+    while(n >= 10){
+        n -= 10;
+        tens += 0x10;
+    }
+    return tens | n;
+}               // returns n (0 to 99) as packed BCD
+void countdownSet(countdown_t *t, unsigned int minutes){
+    unsigned char hours = 0;
+    while(minutes >= 60){
+        minutes -= 60;
+        hours++;
+    }
+    t->bcd[0] = toBcd(hours);
+    t->bcd[1] = toBcd(minutes);
+    t->bcd[2] = 0;
+}               // loads minutes (up to 99 hours) into t
+int countdownDone(const countdown_t *t){
+    return (t->bcd[0] | t->bcd[1] | t->bcd[2]) == 0;
+}               // returns 1 once t is at 00:00:00
+unsigned char countdownStep(countdown_t *t){
+    unsigned char changed = 0;
+    if(countdownDone(t)){
+        return 0;
+    }
+    for(int i = 2; i >= 0; i--){
+        unsigned char b = t->bcd[i];
+        unsigned char shift = (2 - i) * 2;
+        if(b & 0x0f){
+            t->bcd[i] = b - 1;      // x5 -> x4, only the ones digit changes
+            return changed | (0b01 << shift);
         }
-        
+        if(b){
+            t->bcd[i] = b - 7;      // x0 -> (x-1)9, i.e. - 0x10 + 9
+            return changed | (0b11 << shift);
+        }
+        t->bcd[i] = i ? 0x59 : 0x99; // 00 -> 59 and borrow from the next byte
+        changed |= 0b11 << shift;
     }
-    
-    //delay(1);
-    return leftNum * 10 + rightNum;
-    
-    
-}             //returns the break time in minutes
-int getRotations(){
-    int rots = 1;
+    return changed;
+}               // counts t down one second, returns which digits changed: bit 0 seconds ones
+                // to bit 5 hours tens. Does nothing and returns 0 at 00:00:00
+
+unsigned int bootTicks = 0;     // uptimeTicks() when the first screen took buttons, power-on to input-ready
+void welcome(){
+    play_song(introSong); // Play the song
+    motor_play(hapticWelcome); // Motor Vibration
     clearDisplay();
-    printStr("Rotations: ");
-    print(rots);
-    cursorLeft(1); //go back to leftmost number
-    int input;
-    
-    while(1){
-        
-        input = user_input();
-        
-        if(input == 4){
-            rots++;
-            if(rots > 9){
-                rots = 0;
-            }
-            print(rots);
-            cursorLeft(1);
-            //delay(1);
-        }
-        else if(input == 2){
-            rots--;
-            if(rots < 0){
-                rots = 9;
-            }
-            print(rots);
-            cursorLeft(1);
-            //delay(1);
-        } else if(input == 1){
-            break;
+    printStr("Welcome to:");
+    setCursor(1, 0);
+    printStr("Study Buddy");
+    schedule(sessionTimeout, 3 * 1024);
+    if(!bootTicks){
+        bootTicks = uptimeTicks();
+    }
+}                  // welcome message, any button skips it
+void prompt(){
+    clearDisplay();
+    if(settingsSlot < 0){
+        printStr("Press select");
+        setCursor(1, 0);
+        printStr("to start:");
+    } else {
+        unsigned char study = toBcd(userStudy);
+        unsigned char rest = toBcd(userBreak);
+        printStr("Select: new");
+        setCursor(1, 0);
+        printStr("Up: last ");
+        print(study >> 4);
+        print(study & 0x0f);
+        print('/');
+        print(rest >> 4);
+        print(rest & 0x0f);
+        print('x');
+        print(userRotations);
+    }
+    buttonFlush(); // presses made during the banner don't count
+}                  // asks for select to start, or up to repeat the saved settings
+void calibrateShow(){
+    static const char *const names[LADDER_SIZE] = {"left", "right", "up", "down", "select"};
+    clearDisplay();
+    printStr("Calibrate:");
+    setCursor(1, 0);
+    printStr("hold ");
+    printStr(names[calibrateStep]);
+    schedule(sessionTimeout, 30 * 1024);
+}                  // asks for the next button to be held down
+void calibrate(){
+    buttonCalibrating = 1;
+    calibrateStep = 0;
+    calibratePressed = 0;       // left is still down from the prompt
+    calibrateShow();
+}                  // starts learning the button levels, every press reads as select meanwhile
+int calibrateKey(int event){
+    if(!(event & 0b10000000)){
+        calibratePressed = 1;
+        return 0;
+    }
+    if(!calibratePressed || calibrateStep >= LADDER_SIZE){
+        return 0;
+    }
+    calibratePressed = 0;
+    if(buttonHeldCount < BUTTON_DEBOUNCE){
+        return 0;   // let go too soon, hold it again
+    }
+    calibrateLevel[calibrateStep++] = buttonHeldSum / buttonHeldCount;
+    if(calibrateStep < LADDER_SIZE){
+        calibrateShow();
+        return 0;
+    }
+    buttonCalibrating = 0;
+    clearDisplay();
+    if(ladderValid(calibrateLevel)){
+        for(int i = 0; i < LADDER_SIZE; i++){
+            ladder[i].level = calibrateLevel[i];
         }
-        
+        ladderThresholds();
+        calibrationSave();
+        printStr("Calibrated");
+    } else {
+        printStr("Levels too close");
+        setCursor(1, 0);
+        printStr("kept old ones");
     }
-    
-    //delay(1);
-    return rots;
-}              //returns the number of rotations (cycles)
+    return 1;
+}                  // takes the level of each release, returns 1 once every button is done
+void timeEditor(const char *label, int minutes){
+    clearDisplay();
+    printStr(label);
+    printStr("  m");
+    spinnerOpen(0, 12, 2, 1, 99, minutes);
+}                  // shows a two digit minutes editor starting at minutes
+void rotationsEditor(){
+    clearDisplay();
+    printStr("Rotations: ");
+    spinnerOpen(0, 11, 1, 1, 9, userRotations);
+}                  // shows the rotations editor starting at the last rotations
 void displayInput(int studyTime, int breakTime, int rotations){
    //Displays the chose study/break time and rotations
-   int dig1 = studyTime / 10;
-   int dig2 = studyTime % 10;
-   int dig3 = breakTime / 10;
-   int dig4 = breakTime % 10;
+   unsigned char study = toBcd(studyTime);
+   unsigned char rest = toBcd(breakTime);
    clearDisplay();
    printStr("You chose: ");
-   print(dig1);
-   print(dig2);
+   print(study >> 4);
+   print(study & 0x0f);
    print('/');
-   print(dig3);
-   print(dig4);
-   resetCursor();
-   cursorRow();
+   print(rest >> 4);
+   print(rest & 0x0f);
+   setCursor(1, 0);
    print(rotations);
    printStr(" times!! :D");
-   delay(3);
+   schedule(sessionTimeout, 3 * 1024);
 }
-int indTimer(int x, int rots){
-   //x is number of mins timer will run for
-   int x_seconds = x * 60;
-   // above converts x from minutes to seconds
-   resetCursor();
-   cursorRow();
-   printStr("Rotations Left:");
-   print(rots);
-  
-   while(x_seconds > 0){
-         x_seconds--;
-       while(!secondPassed()){}
-         resetCursor();
-         cursorRight(11);
-         int seconds = x_seconds % 60;
-         int minutes = (x_seconds - seconds) / 60;
-         //convert i into minutes & seconds
-         int dig1 = minutes / 10;
-         int dig2 = minutes % 10;
-         int dig3 = seconds / 10;
-         int dig4 = seconds % 10;
-         //convert minutes and seconds to individual digits to be passed to print function
-         print(dig1);
-         print(dig2);
-         print(':');
-         print(dig3);
-         print(dig4);
-         //print countdown to LCD screen
-    }
-}   //Should print timer starting at 11th digit on LCD
-void allTimer(int studyTime, int breakTime, int rotations){  
-   //This function calls the indTimer function to do the chosen study/break times for the chosen rotations
-   for(int i = rotations; i > 0; i--){
-      PORTA.OUT |= 0b00000001; // Turn off LED_2
-      PORTA.OUT &= 0b11111101; // Turn on LED_1 (Study LED)      
-      study_song(); // Play the song
-      motor_buzz(); // Motor Vibration
-      clearDisplay();
-      resetCursor();
-      printStr("Study Time ");
-      indTimer(studyTime, i);
-      clearDisplay();
-      printStr("Switch!");
-      for(int count = 0; count < 2; count++){   // Switch LED states
-        PORTA.OUT |= 0b00000010; // Turn off LED_1
-        PORTA.OUT &= 0b11111110; // Turn on LED_2   
-        delay(1);
-        PORTA.OUT |= 0b00000001; // Turn off LED_2
-        PORTA.OUT &= 0b11111101; // Turn on LED_1
-        delay(1);
-      }
-      PORTA.OUT |= 0b00000010; // Turn off LED_1      
-      PORTA.OUT &= 0b11111110; // Turn on LED_2 (Break LED)         
-      while(!secondPassed());
-      clearDisplay();
-      if(i > 1){
-        break_song(); // Play the song
-        motor_buzz(); // Motor Vibration
-        clearDisplay();
-        resetCursor();
-        printStr("Break Time ");
-        indTimer(breakTime, i);
-        clearDisplay();
-        printStr("Switch!");
-        for(int count = 0; count < 2; count++){   // Switch LED states
-            PORTA.OUT |= 0b00000001; // Turn off LED_2
-            PORTA.OUT &= 0b11111101; // Turn on LED_1
-            delay(1);
-            PORTA.OUT |= 0b00000010; // Turn off LED_1
-            PORTA.OUT &= 0b11111110; // Turn on LED_2   
-            delay(1);
-        }
-        while(!secondPassed());
+void showTimerLabel(){
+   unsigned char hours = countdown.bcd[0];
+   int col;
+   for(col = 0; timerLabel[col] != '\0' && !(hours && timerLabel[col] == ' '); col++){
+      framePut(0, col, timerLabel[col]);
+   }
+   for(; col < 11; col++){
+      framePut(0, col, ' ');
+   }
+   if(hours){
+      framePut(0, 8, (hours >> 4) ? '0' + (hours >> 4) : ' ');
+      framePut(0, 9, '0' + (hours & 0x0f));
+      framePut(0, 10, ':');
+   }
+}   //Puts the label left of mm:ss, only its first word and the hours while there are any
+void showTimer(unsigned char changed){
+   static const unsigned char cols[4] = {15, 14, 12, 11};  // seconds ones to minutes tens
+   if(changed & 0b110000){
+      showTimerLabel();
+   }
+   for(int i = 0; i < 4; i++){
+      if(changed & (1 << i)){
+         unsigned char b = countdown.bcd[2 - i / 2];
+         framePut(0, cols[i], '0' + ((i & 1) ? b >> 4 : b & 0x0f));
       }
    }
-}                   // Includes LED
+   frameFlush();
+   //only the digits that changed are put in the frame and sent to the LCD
+}   //Shows the digits of the countdown that changed (see countdownStep()) at the end of the first row
+void indTimer(const char *label, int x, int rots){
+   //x is number of mins timer will run for, counted from the end of the last phase
+   tickDeadline = phaseDeadline;
+   phaseDeadline += x * 60 * 1024UL;
+   countdownSet(&countdown, x);
+   timerLabel = label;
+   frameClear();
+   showTimerLabel();
+   framePut(0, 13, ':');
+   framePrint(1, 0, "Rotations Left:");
+   framePut(1, 15, '0' + rots);
+   showTimer(0b001111);
+   if(countdownDone(&countdown)){
+      schedule(sessionTimeout, 0);
+      return;
+   }
+   tickDeadline += 1024;
+   scheduleAt(timerTick, tickDeadline);
+}   //Starts a countdown screen that ends at phaseDeadline, timerTick() runs it down
+void timerTick(){
+   PROBE_ENTER(PROBE_TIMER_TICK);
+   unsigned char changed = countdownStep(&countdown);
+   trace(TRACE_TICK, changed);
+   showTimer(changed);
+   if(countdownDone(&countdown)){
+      schedule(sessionTimeout, 0);  // tickDeadline is phaseDeadline now
+   } else {
+      tickDeadline += 1024;
+      scheduleAt(timerTick, tickDeadline);
+   }
+   PROBE_EXIT(PROBE_TIMER_TICK);
+}   //Timed task, counts the countdown down a second and runs again on the next whole second of the phase
+void switchScreen(int from){
+   switchFrom = from;
+   trace(TRACE_PHASE, STATE_SWITCH);
+   phaseDeadline += 5 * 1024UL;
+   scheduleAt(sessionTimeout, phaseDeadline);
+   frameClear();
+   framePrint(0, 0, "Switch!");
+   frameFlush();
+   if(from == STATE_STUDY){
+      breakLed();
+   } else {
+      studyLed();
+   }
+   blinksLeft = 4;
+   schedule(ledBlink, 1024);
+}   //Shows "Switch!" and blinks the LEDs for 5 seconds from phaseDeadline
 void closing(){
-    end_song(); // Play the song
-    motor_buzz(); // Motor Vibration
+    closingStep = 0;
+    ledsOff();
+    play_song(endSong); // Play the song
+    motor_play(hapticEnd); // Motor Vibration
+    historyClose();
     clearDisplay();
-    resetCursor();
     printStr("All Done!");
-    delay(3);
-}                  //closing message
+    setCursor(1, 0);
+    printStr("Total ");
+    printNum(history.focusTotal);
+    printStr(" min");
+    schedule(sessionTimeout, 3 * 1024);
+}                  //closing message with the study minutes of every logged session
+void closingNext(){
+    closingStep++;
+#ifdef SESSION_STATS
+    if(closingStep == 1){
+        // how long the core was awake during the session, see sleepUntilEvent()
+        clearDisplay();
+        printStr("Wakeups:");
+        printNum(sessionWakeups);
+        setCursor(1, 0);
+        printStr("Active:");
+        printNum(sessionActiveCycles());
+        schedule(sessionTimeout, 3 * 1024);
+        return;
+    }
+    if(closingStep == 2){
+        // slowest press-to-read time, debounce alone is about 8ms
+        clearDisplay();
+        printStr("Btn lag ms:");
+        printNum(buttonLatencyMax * 1000UL / 1024);
+        setCursor(1, 0);
+        printStr("Boot ms:");
+        printNum(bootTicks * 1000UL / 1024);
+        schedule(sessionTimeout, 3 * 1024);
+        return;
+    }
+#endif
+#ifdef PROFILE
+    int screen = closingStep;
+#ifdef SESSION_STATS
+    screen -= 2;    // after the two stats screens
+#endif
+    if(screen <= PROBE_COUNT){
+        // one probe a screen: name and calls, then min/average/max cycles
+        static const char *const probeNames[PROBE_COUNT] = {"enable", "print", "speaker", "motor", "timerTick"};
+        const probe_t *p = &probes[screen - 1];
+        clearDisplay();
+        printStr(probeNames[screen - 1]);
+        printStr(" x");
+        printNum(p->calls);
+        setCursor(1, 0);
+        if(p->calls){
+            printNum(p->min);
+            print('/');
+            printNum(p->total / p->calls);
+            print('/');
+            printNum(p->max);
+            print('c');
+        }
+        schedule(sessionTimeout, 3 * 1024);
+        return;
+    }
+    if(screen == PROBE_COUNT + 1){
+        // what probing adds to each call counted above
+        clearDisplay();
+        printStr("Probe cost");
+        setCursor(1, 0);
+        printNum(probeCost);
+        printStr("c a call");
+        schedule(sessionTimeout, 3 * 1024);
+        return;
+    }
+#endif
+    sessionEnter(STATE_WELCOME);
+}                  //moves on from the closing message, through the stats and probe screens if enabled
+
+void sessionEnter(int next){
+    state = next;
+    trace(TRACE_PHASE, next);
+    cancelTask(sessionTimeout);
+    buttonsWatch(next <= STATE_ROTS_IN || next == STATE_CALIBRATE);
+    buttonCalibrating = 0;
+    switch(next){
+        case STATE_WELCOME:
+            welcome();
+            break;
+        case STATE_PROMPT:
+            prompt();
+            break;
+        case STATE_STUDY_IN:
+            timeEditor("Study Time: ", userStudy);
+            break;
+        case STATE_BREAK_IN:
+            timeEditor("Break Time: ", userBreak);
+            break;
+        case STATE_ROTS_IN:
+            rotationsEditor();
+            break;
+        case STATE_CONFIRM:
+            displayInput(userStudy, userBreak, userRotations);
+            break;
+        case STATE_STUDY:
+            studyLed();
+            play_song(studySong); // Play the song
+            motor_play(hapticStudy); // Motor Vibration
+            indTimer("Study Time ", userStudy, rotsLeft);
+            break;
+        case STATE_BREAK:
+            breakLed();
+            play_song(breakSong); // Play the song
+            motor_play(hapticBreak); // Motor Vibration
+            indTimer("Break Time ", userBreak, rotsLeft);
+            break;
+        case STATE_CLOSING:
+            closing();
+            break;
+        case STATE_CALIBRATE:
+            calibrate();
+            break;
+    }
+}               // switches the session to state next and runs its entry actions
+void sessionTimeout(){
+    switch(state){
+        case STATE_WELCOME:
+            sessionEnter(STATE_PROMPT);
+            break;
+        case STATE_CONFIRM:
+            settingsSave();
+            historyStart();
+            resetSessionStats();
+            rotsLeft = userRotations;
+            phaseDeadline = uptimeTicks();  // every phase ends a whole number of seconds after this
+            sessionEnter(rotsLeft > 0 ? STATE_STUDY : STATE_CLOSING);
+            break;
+        case STATE_STUDY:
+            historyStudyDone();
+            switchScreen(state);
+            state = STATE_SWITCH;
+            break;
+        case STATE_BREAK:
+            switchScreen(state);
+            state = STATE_SWITCH;
+            break;
+        case STATE_SWITCH:
+            if(switchFrom == STATE_BREAK){
+                rotsLeft--;
+                sessionEnter(STATE_STUDY);
+            } else if(rotsLeft > 1){
+                sessionEnter(STATE_BREAK);
+            } else {
+                sessionEnter(STATE_CLOSING);
+            }
+            break;
+        case STATE_CLOSING:
+            closingNext();
+            break;
+        case STATE_CALIBRATE:
+            sessionEnter(STATE_PROMPT);     // done, or left half way
+            break;
+    }
+}               // timed task, ends the screens that only stay up for a while
+void sessionButton(int event){
+    switch(state){
+        case STATE_WELCOME:
+            if(!(event & 0b10000000)){
+                sessionEnter(STATE_PROMPT);    // the intro song plays on
+            }
+            break;
+        case STATE_PROMPT:
+            if(event == 1){
+                sessionEnter(STATE_STUDY_IN);
+            }
+            else if(event == 4 && settingsSlot >= 0){
+                sessionEnter(STATE_CONFIRM);   // repeat the last session
+            }
+            else if(event == 5){
+                sessionEnter(STATE_CALIBRATE);
+            }
+            break;
+        case STATE_CALIBRATE:
+            if(calibrateKey(event)){
+                schedule(sessionTimeout, 2 * 1024);
+            }
+            break;
+        case STATE_STUDY_IN:
+            if(spinnerKey(event)){
+                userStudy = spinnerValue();
+                sessionEnter(STATE_BREAK_IN);
+            }
+            break;
+        case STATE_BREAK_IN:
+            if(spinnerKey(event)){
+                userBreak = spinnerValue();
+                sessionEnter(STATE_ROTS_IN);
+            }
+            break;
+        case STATE_ROTS_IN:
+            if(spinnerKey(event)){
+                userRotations = spinnerValue();
+                sessionEnter(STATE_CONFIRM);
+            }
+            break;
+    }
+}               // handles one button event, releases only matter to the spinner
+
+#ifdef BENCHMARK
+// Hot path benchmark, build with -DBENCHMARK to run it instead of the session.
+// Each routine runs BENCH_RUNS times on the TCB1 active cycle count and the fastest run is kept,
+// so an interrupt landing in one run does not count. This is repeated at every clock of the plan,
+// the LCD shows cycles and microseconds, SLOW when the routine took longer than its baseline.
+// With -DTRACE every result also goes out as a TRACE_BENCH event, and main() returns the
+// number of SLOW results, which is the exit status of the host build.
+// The board baselines are budgets worked out from the LCD's datasheet waits with headroom for
+// the code, not yet measured on a board; a -DTRACE run on one gives the numbers to replace them.
+// The host build charges SIM_BLOCK_CYCLES for every basic block the firmware runs (see
+// host/sim.c), and its baselines are the 4MHz results of that model with about 10% headroom.
+#define BENCH_RUNS 8
+#define BENCH_SLOW      0b10000000  // TRACE_BENCH arg: took longer than its baseline
+#define BENCH_DONE      0xff        // TRACE_BENCH arg of the last event, value = SLOW results
+#ifdef HOST_SIM
+#define BENCH_US(part, host) (host)
+#else
+#define BENCH_US(part, host) (part)
+#endif
+
+typedef struct {
+    const char *name;           // at most 12 characters, the result goes after it
+    void (*setup)(void);        // puts the display in the state the routine expects, or 0
+    void (*run)(void);
+    unsigned int baseline;      // most microseconds the routine may take at F_CPU, faster clocks only take less
+} bench_t;
+
+void benchNothing(){
+}   //times the call itself, taken off every result
+void benchPrintStr(){
+    printStr("Study Time 00:00");
+}
+void benchTimerSetup(){
+    phaseDeadline = uptimeTicks();
+    indTimer("Study Time ", 10, 1);
+}
+void benchTimerTick(){
+    timerTick();
+}
+void benchButtonEvent(){
+    buttonEvent();
+}
+void benchMotorStop(){
+    cancelTask(motor_step);
+    motor_set(0);
+}
+void benchMotorPlay(){
+    motor_play(hapticWelcome);
+}
+
+const bench_t benches[] = {
+    {"printStr",     resetCursor,      benchPrintStr,    BENCH_US(1300, 1450)},
+    {"clearDisplay", 0,                clearDisplay,     BENCH_US(1850, 2030)},
+    {"cursorRow",    0,                cursorRow,        BENCH_US(105, 75)},
+    {"timerTick",    benchTimerSetup,  benchTimerTick,   BENCH_US(500, 870)},
+    {"buttonEvent",  0,                benchButtonEvent, BENCH_US(30, 6)},
+    {"motor_play",   benchMotorStop,   benchMotorPlay,   BENCH_US(75, 75)},
+};
+
+unsigned long benchCycles(const bench_t *b){
+    unsigned long best = 0xffffffff;
+    for(int i = 0; i < BENCH_RUNS; i++){
+        unsigned long start;
+        unsigned long cycles;
+        if(b->setup){
+            b->setup();
+        }
+        start = sessionActiveCycles();
+        b->run();
+        cycles = sessionActiveCycles() - start;
+        if(cycles < best){
+            best = cycles;
+        }
+    }
+    return best;
+}   //returns the fastest of BENCH_RUNS runs in CPU cycles
+void benchDrain(){
+    while(traceBusy()){
+        cli();
+        sleepUntilEvent();
+    }
+}   //sleeps until the trace has sent everything, clockSet() does nothing before that
+void benchReport(unsigned int us, unsigned char arg){
+    benchDrain();
+    traceEvent(TRACE_BENCH, us, arg);
+}   //sends one TRACE_BENCH event once the queue is empty, so it is never dropped
+int benchClock(){
+    bench_t empty = {"", 0, benchNothing, 0};
+    unsigned long overhead = benchCycles(&empty);
+    int slow = 0;
+    clearDisplay();
+    printStr("Clock ");
+    printNum(cpuHz / 1000000);
+    printStr("MHz");
+    delay(2);
+    for(unsigned int i = 0; i < sizeof(benches) / sizeof(benches[0]); i++){
+        unsigned long cycles = benchCycles(&benches[i]) - overhead;
+        unsigned long us = cycles * 1000 / (cpuHz / 1000);
+        clearDisplay();
+        printStr(benches[i].name);
+        setCursor(0, 12);
+        unsigned char arg = i + 16 * clockState;
+        if(us > benches[i].baseline){
+            printStr("SLOW");
+            arg |= BENCH_SLOW;
+            slow++;
+        } else {
+            printStr("  ok");
+        }
+        benchReport(us > 0xffff ? 0xffff : us, arg);
+        setCursor(1, 0);
+        printNum(cycles);
+        printStr("c ");
+        printNum(us);
+        printStr("us");
+        delay(2);
+    }
+    benchMotorStop();
+    return slow;
+}   //times every routine in benches[] at the current clock, shows and sends the results, returns how many were SLOW
+int benchRun(){
+    int slow = 0;
+    for(unsigned char state = CLOCK_SLOW; state <= CLOCK_FAST; state++){
+        benchDrain();
+        clockSet(state);
+        slow += benchClock();
+    }
+    benchDrain();
+    clockSet(CLOCK_SLOW);
+    clearDisplay();
+    printStr("Benchmark done");
+    setCursor(1, 0);
+    printNum(slow);
+    printStr(" slow");
+    benchReport(slow, BENCH_DONE);
+    benchDrain();   // returning from main() turns interrupts off, the report has to be out first
+    return slow;
+}   //runs benchClock() at every clock of the plan, returns how many results were SLOW
+#endif
 
 int main(void) {
     
+    // the RTC starts first so everything up to initDisplay() runs inside the LCD's power-up time
+    initClock();
     init_speaker_motor();
     initButton();
+    ledsOff();
+#ifdef TRACE
+    initTrace();
+#endif
+    settingsLoad();
+    calibrationLoad();
+    historyLoad();
     initDisplay();
-    initClock();
+#ifdef LCD_REPORT_RATE
+    lcdReportRate();
+#endif
 
-    int userStudy;
-    int userBreak;
-    int userRotations;
-    
-    PORTA.OUT |= 0b00000010; // Turn on LED_1
-    PORTA.OUT |= 0b00000001; // Turn on LED_2 
+#ifdef BENCHMARK
+    return benchRun();
+#endif
+    sessionEnter(STATE_WELCOME);
     
     while(1){
+      int event;
       
-      
-      welcome();
-      while(!secondPassed()){}
-      userStudy = getStudyInput();
-      while(!secondPassed()){}
-      userBreak = getBreakInput();
-      while(!secondPassed()){}
-      userRotations = getRotations();
-      displayInput(userStudy, userBreak, userRotations);
-      allTimer(userStudy, userBreak, userRotations);
-      PORTA.OUT |= 0b00000010; // Turn on LED_1
-      PORTA.OUT |= 0b00000001; // Turn on LED_2
-      closing();
+      event = buttonEvent();
+      if(event){
+        clockSet(CLOCK_FAST);
+        trace(TRACE_BUTTON, event);
+        sessionButton(event);
+      }
+      runDueTasks();
+      idle();
       
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,19 @@
+#!/bin/sh
+# Runs the -DBENCHMARK build in the sim with CPU time charged per basic block (see charge() in
+# host/sim.c) and prints every result. Exits with the number of SLOW results, 1 on an LCD
+# timing violation, 3 if no CPU time was charged.
+# Usage: host/check-bench.sh
+cd "$(dirname "$0")/.." || exit 2
+SIM=${TMPDIR:-/tmp}/studybuddy-check-bench
+
+gcc -std=gnu99 -DHOST_SIM -DBENCHMARK -fsanitize-coverage=trace-pc -I. -c "300 Project Code.c" -o "$SIM.o" || exit 2
+gcc -std=gnu99 -I. "$SIM.o" host/sim.c -o "$SIM" || exit 2
+"$SIM" > "$SIM.out"
+status=$?
+rm -f "$SIM" "$SIM.o"
+grep "lcd   |[A-Za-z_]* *\(ok\|SLOW\)|\|lcd   |Clock\|lcd   |Benchmark\|lcd   written\|sim  " "$SIM.out"
+rm -f "$SIM.out"
+if [ $status -ne 0 ]; then
+    echo "benchmark exited with $status"
+fi
+exit $status
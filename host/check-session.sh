@@ -0,0 +1,72 @@
+#!/bin/sh
+# Runs host/session.txt in the sim and checks the session timing against the clock.
+# The session starts when the "You chose" screen has been up 3s. Every "Switch!" has to show
+# when its phase ends, and "All Done!" 5s after the last one, each within TOLERANCE seconds
+# (the LCD takes a few ms to write). Exits 1 on a late or early screen, a missing one, or an
+# LCD timing violation. The session runs twice: with the LCD's R/W pin on ground, and on PD6
+# (-DLCD_RW_bm) so the busy flag is polled.
+# Usage: host/check-session.sh [script]
+TOLERANCE=0.010
+cd "$(dirname "$0")/.." || exit 2
+SCRIPT=${1:-host/session.txt}
+SIM=${TMPDIR:-/tmp}/studybuddy-check-sim
+
+check(){
+    gcc -std=gnu99 -DHOST_SIM $1 -I. "300 Project Code.c" host/sim.c -o "$SIM" || return 2
+    "$SIM" "$SCRIPT" > "$SIM.out"
+    status=$?
+    rm -f "$SIM"
+    if [ $status -ne 0 ]; then
+        grep "sim \|lcd   written\|lcd   read" "$SIM.out"
+        echo "sim exited with $status"
+        return 1
+    fi
+
+    awk -v tol=$TOLERANCE '
+    function check(what, t, expected){
+        late = t - expected
+        if(late < -tol || late > tol){
+            printf("FAIL %-10s at %.3f, due at %.3f\n", what, t, expected)
+            failed = 1
+        } else {
+            printf("ok   %-10s at %.3f\n", what, t)
+        }
+    }
+    /lcd   \|You chose: / && !started {
+        match($0, /You chose: [0-9]+\/[0-9]+\|[0-9]/)
+        split(substr($0, RSTART + 11, RLENGTH - 11), v, /[\/|]/)
+        study = v[1] * 60; rest = v[2] * 60; rotations = v[3]
+        due = $1 + 3 + study
+        started = 1
+        next
+    }
+    /lcd   \|Switch! / && started && !done {
+        switches++
+        check("Switch!", $1, due)
+        due += 5 + (switches % 2 ? rest : study)
+        next
+    }
+    /lcd   \|All Done! / && started && !done {
+        check("All Done!", $1, due - (switches % 2 ? rest : study))
+        done = 1
+    }
+    END {
+        if(!started){ print "FAIL no session was confirmed"; exit 1 }
+        if(!done){ print "FAIL no All Done!"; exit 1 }
+        if(switches != 2 * rotations - 1){
+            printf("FAIL %d switch screens for %d rotations\n", switches, rotations)
+            exit 1
+        }
+        exit failed
+    }' "$SIM.out"
+    status=$?
+    rm -f "$SIM.out"
+    return $status
+}
+
+failed=0
+for build in "" "-DLCD_RW_bm=0b01000000"; do
+    echo "build ${build:-default}"
+    check "$build" || failed=1
+done
+exit $failed
@@ -0,0 +1,862 @@
+/*
+ * File:   sim.c
+ * Simulated AVR128DB28 peripherals for the host build of the firmware, see sim.h
+ *
+ * Virtual time only moves while the firmware waits in _delay_loop_2() or sleeps in
+ * sleep_cpu(), code between them runs in zero time unless the firmware was compiled with
+ * -fsanitize-coverage=trace-pc (see charge()). Every time it moves the models below
+ * catch up in order of their next event and call the firmware's interrupt handlers.
+ *
+ * Usage: studybuddy-sim [script]
+ * The script holds one button press per line, "<seconds> <button> [hold ms]", where
+ * button is select, left, right, up or down, and "end <seconds>" to stop the run
+ * (600s of virtual time by default). "eeprom <file>" loads the EEPROM from file, if it
+ * exists, and saves it back at the end so the next run starts from it. "trace pty" sends
+ * whatever USART1 transmits to a new pseudo-terminal, "trace <file>" to a file. "ladder <percent>"
+ * scales the ladder voltage of the presses after it, as a drifted ladder would. Whatever the
+ * device shows or plays is printed with its virtual time stamp.
+ */
+#define _XOPEN_SOURCE 600       // posix_openpt()
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+
+PORT_t PORTA, PORTC, PORTD;
+TCA_t TCA0;
+TCB_t TCB1;
+RTC_t RTC;
+ADC_t ADC0;
+VREF_t VREF;
+CLKCTRL_t CLKCTRL;
+SLPCTRL_t SLPCTRL;
+EVSYS_t EVSYS;
+PORTMUX_t PORTMUX;
+NVMCTRL_t NVMCTRL;
+USART_t USART1;
+uint8_t sim_eeprom[EEPROM_SIZE];
+register8_t CCP;
+register8_t SREG;
+
+extern unsigned long cpuHz;     // the firmware's idea of CLK_CPU, checked against OSCHF
+
+// the firmware's interrupt handlers, weak so vectors it does not use are just skipped
+void RTC_CNT_vect(void) __attribute__((weak));
+void RTC_PIT_vect(void) __attribute__((weak));
+void TCA0_CMP0_vect(void) __attribute__((weak));
+void TCA0_LUNF_vect(void) __attribute__((weak));
+void TCB1_INT_vect(void) __attribute__((weak));
+void ADC0_RESRDY_vect(void) __attribute__((weak));
+void ADC0_WCMP_vect(void) __attribute__((weak));
+void USART1_DRE_vect(void) __attribute__((weak));
+void USART1_TXC_vect(void) __attribute__((weak));
+
+#define NS 1000000000ULL
+#define NEVER UINT64_MAX
+
+static uint64_t now;                    // virtual time in ns
+static uint64_t endTime = 600 * NS;
+static int sleeping;                    // 0 awake, 1 idle, 2 standby
+static unsigned long clockHz = 4000000; // CLK_CPU, from OSCHF FRQSEL
+static uint8_t oschf;                   // OSCHFCTRLA as last accepted
+static int clockWarned;
+static uint64_t awakeNs, awakeSlowNs;   // time spent awake, and at the 4MHz reset clock
+static uint64_t idleNs;                 // time asleep in idle, CLK_PER kept running
+static unsigned long cpuBlocks;         // basic blocks run since time was last charged, see charge()
+static int charging;
+static int cpuCharged;                  // the firmware was built with -fsanitize-coverage=trace-pc
+
+// button presses from the script, as ladder levels over time
+#define MAX_STEPS 512
+static struct { uint64_t at; uint16_t level; } steps[MAX_STEPS];
+static int stepCount, stepNext;
+static uint16_t ladderLevel;
+
+// RTC, clocked at 1.024kHz from OSC1K
+static uint64_t rtcBase;                // RTC clock cycle the counter was enabled at
+static uint64_t pitBase;                // RTC clock cycle the PIT was enabled at
+static int rtcOn, pitOn;
+
+// TCA0 and TCB1, clocked from CLK_PER
+// TCA0 is modelled in frequency mode (period set by CMP0, interrupt on CMP0) and in split mode
+// (low counter period set by LPER, interrupt on LUNF, high counter only drives WO5)
+static uint64_t tcaBase;                // time the TCA0 period last restarted
+static uint8_t tcaCtrla, tcaCtrlb, tcaCtrld;
+static uint16_t tcaTop;
+static uint64_t tcbBase;                // time TCB1 counted from tcbBaseCnt
+static uint16_t tcbBaseCnt, tcbShown;
+static uint64_t tcbWraps;               // times TCB1 passed CCMP since tcbBase
+static int tcbOn;
+
+// ADC0
+static uint64_t adcDone = NEVER;        // time the running conversion finishes
+static unsigned long adcConversions;
+static uint8_t adcFlags;                // INTFLAGS without the SIM_FLAGS_UNWRITTEN marker
+
+// HD44780
+static uint8_t ddram[128];
+static uint8_t lcdAddr, lcdFourBit, lcdHaveHigh, lcdHigh, lcdIncrement = 1;
+static uint8_t lcdReadLow;              // the next 4-bit read gives the low nibble
+static uint64_t lcdReady;               // time the last instruction finishes executing
+static unsigned lcdViolations;
+static char shownLcd[2][17];
+
+// EEPROM
+static uint8_t eepromShown[EEPROM_SIZE]; // contents at the last sync
+static unsigned long eepromWrites;      // bytes that changed
+static char eepromFile[256];
+
+// USART1 transmitter: a data buffer in front of the shift register, as on the part.
+// Writes to STATUS are not modelled, TXCIF clears when its interrupt runs or a byte is written.
+static uint64_t txEnd = NEVER;          // time the frame in the shift register is out
+static int txFull, txComplete;          // data buffer holds txByte, TXCIF
+static uint8_t txByte;
+static uint8_t txStatusShown;
+static unsigned long txBytes;           // bytes sent
+static FILE *txOut;                     // where they go, "trace" in the script
+static int txWarned;
+
+// outputs last printed
+static int shownTone = -1, shownMotor = -1, shownLeds = -1;
+
+static uint64_t rtcTickTime(uint64_t tick){
+    return (tick * NS + 1023) / 1024;
+}
+static uint64_t rtcTicksAt(uint64_t t){
+    return t * 1024 / NS;
+}
+static double cycleNs(void){
+    return (double)NS / clockHz;
+}
+static void stamp(void){
+    printf("%10.3f  ", now / 1e9);
+}
+
+// clock prescalers in CTRLA.CLKSEL and CTRLC.PRESC order
+static const unsigned tcaDiv[] = {1, 2, 4, 8, 16, 64, 256, 1024};
+static const unsigned adcDiv[] = {2, 4, 8, 12, 16, 20, 24, 28, 32, 48, 64, 96, 128, 256, 256, 256};
+
+static int tcaSplit(void){
+    return TCA0.SINGLE.CTRLD & 0b00000001;
+}
+static uint16_t tcaTopNow(void){
+    if(tcaSplit()){
+        return TCA0.SPLIT.LPER;
+    }
+    return (TCA0.SINGLE.CTRLB & 0b00000111) == 0b001 ? TCA0.SINGLE.CMP0 : TCA0.SINGLE.PER;
+}
+static uint8_t tcaFlag(void){
+    return tcaSplit() ? 0b00000001 : 0b00010000;   // LUNF or CMP0
+}
+static uint64_t tcaPeriod(void){
+    return (uint64_t)((tcaTop + 1.0) * tcaDiv[(tcaCtrla >> 1) & 0b111] * cycleNs());
+}
+static int tcaRunning(void){
+    return (tcaCtrla & 0b00000001) && !(sleeping == 2 && !(tcaCtrla & 0b10000000));
+}
+static int adcRunning(void){
+    return (ADC0.CTRLA & 0b00000001) && !(sleeping == 2 && !(ADC0.CTRLA & 0b10000000));
+}
+// conversions added up into one result, CTRLB.SAMPNUM
+static unsigned adcSamples(void){
+    return 1 << (ADC0.CTRLB & 0b111);
+}
+static uint64_t adcConversion(void){
+    return (uint64_t)(adcSamples() * (15.0 + ADC0.SAMPCTRL) * adcDiv[ADC0.CTRLC & 0b1111] * cycleNs());
+}
+// RTC ticks between the PIT events EVSYS routes to the ADC0 start input, 0 if none is
+static uint64_t adcTriggerPeriod(void){
+    int channel = EVSYS.USERADC0START - 1;
+    if(!pitOn || !(ADC0.EVCTRL & 0b00000001) || channel < 0 || channel > 9){
+        return 0;
+    }
+    uint8_t generator = (&EVSYS.CHANNEL0)[channel];
+    if(generator < 0x08 || generator > 0x0B){
+        return 0;   // only the RTC_PIT_DIVn generators are modelled
+    }
+    // even channels get CLK_RTC / 8192 to / 1024, odd ones / 512 to / 64
+    return (channel & 1 ? 512 : 8192) >> (generator - 0x08);
+}
+// the window comparator's verdict on result res, CTRLE.WINCM
+static int adcWindow(uint16_t res){
+    switch(ADC0.CTRLE & 0b111){
+        case 1: return res < ADC0.WINLT;
+        case 2: return res > ADC0.WINHT;
+        case 3: return res > ADC0.WINLT && res < ADC0.WINHT;
+        case 4: return res < ADC0.WINLT || res > ADC0.WINHT;
+    }
+    return 0;
+}
+
+// applies writes to the DIRSET/DIRCLR/OUTSET/OUTCLR/OUTTGL strobes of a port
+static void strobes(PORT_t *port){
+    port->DIR = (port->DIR | port->DIRSET) & ~port->DIRCLR;
+    port->OUT = ((port->OUT | port->OUTSET) & ~port->OUTCLR) ^ port->OUTTGL;
+    port->DIRSET = port->DIRCLR = port->OUTSET = port->OUTCLR = port->OUTTGL = 0;
+}
+
+// starts shifting out byte b, 8N1 at the rate BAUD gives
+static void txStart(uint8_t b){
+    double bitNs = USART1.BAUD * cycleNs() / 4;     // 16 * BAUD / (64 * CLK_PER)
+    txEnd = now + (uint64_t)(10 * bitNs);
+    txBytes++;
+    if(txOut){
+        fputc(b, txOut);
+        fflush(txOut);
+        clearerr(txOut);    // nobody on the pty yet, the byte is lost as it would be on the wire
+    }
+}
+
+// picks up whatever the firmware wrote to the registers since the last call
+static void sync(void){
+    strobes(&PORTA);
+    strobes(&PORTD);
+
+    // OSCHF is under configuration change protection, writes without CCP are ignored
+    if(CLKCTRL.OSCHFCTRLA != oschf){
+        static const unsigned long frqsel[16] = {1000000, 2000000, 3000000, 4000000, 0, 8000000, 12000000,
+                                                 16000000, 20000000, 24000000};
+        unsigned long hz = frqsel[(CLKCTRL.OSCHFCTRLA >> 2) & 0b1111];
+        if(CCP != 0xD8 || !hz){
+            stamp();
+            printf("sim   OSCHFCTRLA write ignored, %s\n", hz ? "no CCP unlock" : "reserved FRQSEL");
+            CLKCTRL.OSCHFCTRLA = oschf;
+        } else {
+            if(txEnd != NEVER && !txWarned){
+                stamp();
+                printf("sim   clock changed while USART1 was sending, the byte is garbled\n");
+                txWarned = 1;
+            }
+            oschf = CLKCTRL.OSCHFCTRLA;
+            clockHz = hz;
+            tcbBaseCnt = TCB1.CNT;
+            tcbBase = now;
+            tcaBase = now;
+        }
+    }
+    CCP = 0;
+    for(int i = 0; i < EEPROM_SIZE; i++){
+        if(sim_eeprom[i] != eepromShown[i]){
+            eepromShown[i] = sim_eeprom[i];
+            eepromWrites++;
+        }
+    }
+    if(clockHz != cpuHz && !clockWarned){
+        stamp();
+        printf("sim   firmware thinks CLK_CPU is %luHz, OSCHF runs at %luHz\n", cpuHz, clockHz);
+        clockWarned = 1;
+    }
+
+    if((RTC.CTRLA & 0b00000001) && !rtcOn){
+        rtcBase = rtcTicksAt(now);
+        rtcOn = 1;
+    }
+    if((RTC.PITCTRLA & 0b00000001) && !pitOn){
+        pitBase = rtcTicksAt(now);
+        pitOn = 1;
+    }
+    if(rtcOn){
+        RTC.CNT = rtcTicksAt(now) - rtcBase;
+    }
+
+    // LCNT reads are not modelled, the sim keeps it at 0 to see the firmware restart the period
+    if(TCA0.SINGLE.CTRLA != tcaCtrla || TCA0.SINGLE.CTRLB != tcaCtrlb || TCA0.SINGLE.CTRLD != tcaCtrld
+       || tcaTopNow() != tcaTop || (tcaSplit() && TCA0.SPLIT.LCNT)){
+        tcaCtrla = TCA0.SINGLE.CTRLA;
+        tcaCtrlb = TCA0.SINGLE.CTRLB;
+        tcaCtrld = TCA0.SINGLE.CTRLD;
+        tcaTop = tcaTopNow();
+        tcaBase = now;
+        if(tcaSplit()){
+            TCA0.SPLIT.LCNT = 0;
+        }
+    }
+
+    int on = TCB1.CTRLA & 0b00000001;
+    if(TCB1.CNT != tcbShown || on != tcbOn){
+        tcbBaseCnt = TCB1.CNT;      // firmware wrote CNT or started/stopped the counter
+        tcbBase = now;
+        tcbWraps = 0;
+    } else if(on){
+        uint64_t top = (uint64_t)TCB1.CCMP + 1;
+        uint64_t total = tcbBaseCnt + (uint64_t)((now - tcbBase) / cycleNs());
+        if(total / top != tcbWraps){
+            tcbWraps = total / top;
+            TCB1.INTFLAGS |= 0b00000001;
+        }
+        TCB1.CNT = total % top;
+    }
+    tcbOn = on;
+    tcbShown = TCB1.CNT;
+
+    if(USART1.TXDATAL != SIM_TXDATA_EMPTY){
+        uint8_t b = USART1.TXDATAL;
+        USART1.TXDATAL = SIM_TXDATA_EMPTY;
+        if(USART1.CTRLB & 0b01000000){
+            txComplete = 0;
+            if(txEnd == NEVER){
+                txStart(b);
+            } else {
+                txFull = 1;
+                txByte = b;
+            }
+        }
+    }
+    if((txStatusShown & 0b01000000) && !(USART1.STATUS & 0b01000000)){
+        txComplete = 0;     // TXC interrupt ran
+    }
+    USART1.STATUS = txStatusShown = (txFull ? 0 : 0b00100000) | (txComplete ? 0b01000000 : 0);
+    if(sleeping == 2 && txEnd != NEVER && !txWarned){
+        stamp();
+        printf("sim   standby while USART1 was sending, the byte is lost\n");
+        txWarned = 1;
+    }
+
+    if(ADC0.COMMAND & 0b00000001){
+        ADC0.COMMAND = 0;
+        if(adcRunning()){
+            adcDone = now + adcConversion();
+        }
+    }
+    if(!adcRunning()){
+        adcDone = NEVER;
+    } else if(adcDone == NEVER && (ADC0.CTRLA & 0b00000010)){
+        adcDone = now + adcConversion();    // free-running conversions resume after standby
+    }
+    if(!(ADC0.INTFLAGS & SIM_FLAGS_UNWRITTEN)){
+        adcFlags &= ~ADC0.INTFLAGS;         // write-one-to-clear
+    }
+    ADC0.INTFLAGS = SIM_FLAGS_UNWRITTEN | adcFlags;
+}
+
+// prints the LCD and the outputs when they change
+static void report(void){
+    char text[2][17];
+    for(int row = 0; row < 2; row++){
+        for(int col = 0; col < 16; col++){
+            uint8_t c = ddram[row * 0x40 + col];
+            text[row][col] = (c >= ' ' && c < 0x7f) ? c : '?';
+        }
+        text[row][16] = '\0';
+    }
+    if(memcmp(text, shownLcd, sizeof(text))){
+        memcpy(shownLcd, text, sizeof(text));
+        stamp();
+        printf("lcd   |%s|%s|\n", text[0], text[1]);
+    }
+
+    int tone = 0;
+    double tcaHz = (double)clockHz / tcaDiv[(tcaCtrla >> 1) & 0b111];
+    if(tcaRunning() && PORTMUX.TCAROUTEA == 0b011 && (PORTD.DIR & 0b00000010)){
+        if(tcaSplit() && (TCA0.SPLIT.CTRLB & 0b00000010)){
+            tone = (int)(tcaHz / (tcaTop + 1) + 0.5);           // WO1 PWM from the low counter
+        } else if(!tcaSplit() && (TCA0.SINGLE.CTRLB & 0b00100000)){
+            tone = (int)(tcaHz / (2.0 * (tcaTop + 1)) + 0.5);   // WO1 toggling on CMP0
+        }
+    }
+    if(tone != shownTone){
+        shownTone = tone;
+        stamp();
+        if(tone){
+            printf("tone  %dHz\n", tone);
+        } else {
+            printf("tone  off\n");
+        }
+    }
+
+    int motor = 0;     // percent
+    if(PORTD.DIR & 0b00100000){
+        if(tcaSplit() && (TCA0.SPLIT.CTRLB & 0b01000000) && PORTMUX.TCAROUTEA == 0b011){
+            motor = tcaRunning() ? TCA0.SPLIT.HCMP2 * 100 / (TCA0.SPLIT.HPER + 1) : 0;
+        } else if(PORTD.OUT & 0b00100000){
+            motor = 100;
+        }
+    }
+    if(motor != shownMotor){
+        shownMotor = motor;
+        stamp();
+        if(motor){
+            printf("motor %d%%\n", motor);
+        } else {
+            printf("motor off\n");
+        }
+    }
+
+    int leds = ~PORTA.OUT & PORTA.DIR & 0b00000011;
+    if(leds != shownLeds){
+        shownLeds = leds;
+        stamp();
+        printf("leds  study %s, break %s\n", (leds & 0b10) ? "on" : "off", (leds & 0b01) ? "on" : "off");
+    }
+}
+
+static int finished;
+
+static void summary(void){
+    report();
+    stamp();
+    printf("end   awake %.1fms, %.1fms of it at 4MHz\n", awakeNs / 1e6, awakeSlowNs / 1e6);
+    stamp();
+    printf("end   asleep in idle %.1fs, adc conversions: %lu\n", idleNs / 1e9, adcConversions);
+    stamp();
+    printf("end   lcd timing violations: %u\n", lcdViolations);
+    sync();
+    if(eepromWrites){
+        stamp();
+        printf("end   eeprom bytes written: %lu\n", eepromWrites);
+    }
+    if(txBytes){
+        stamp();
+        printf("end   usart bytes sent: %lu\n", txBytes);
+    }
+    if(eepromFile[0]){
+        FILE *f = fopen(eepromFile, "wb");
+        if(!f || fwrite(sim_eeprom, 1, EEPROM_SIZE, f) != EEPROM_SIZE){
+            perror(eepromFile);
+        }
+        if(f){
+            fclose(f);
+        }
+    }
+}
+
+static void finish(void){
+    finished = 1;
+    summary();
+    exit(lcdViolations ? 1 : 0);
+}
+
+// main() returned (benchmark build), keep its exit status unless the LCD was misused
+static void mainReturned(void){
+    if(finished){
+        return;
+    }
+    summary();
+    if(!cpuCharged){
+        printf("sim   no CPU time was charged, build the firmware with -fsanitize-coverage=trace-pc\n");
+        fflush(stdout);
+        _Exit(3);   // the timings are the LCD waits alone, nothing CPU bound was checked
+    }
+    fflush(stdout);
+    if(lcdViolations){
+        _Exit(1);
+    }
+}
+
+static unsigned long handled;           // interrupt handlers run so far
+
+// runs pending interrupts while they are enabled, returns how many ran
+static int service(void){
+    int ran = 0;
+    while(SREG & 0b10000000){
+        void (*handler)(void) = 0;
+        register8_t *flags = 0;
+        uint8_t bit = 0;
+        uint8_t adcBit = 0;
+
+        if(RTC.INTFLAGS & RTC.INTCTRL & 0b00000011){
+            handler = RTC_CNT_vect; flags = &RTC.INTFLAGS; bit = RTC.INTFLAGS & RTC.INTCTRL & 0b00000011;
+        } else if(RTC.PITINTFLAGS & RTC.PITINTCTRL & 0b00000001){
+            handler = RTC_PIT_vect; flags = &RTC.PITINTFLAGS; bit = 0b00000001;
+        } else if(TCA0.SINGLE.INTFLAGS & TCA0.SINGLE.INTCTRL & tcaFlag()){
+            handler = tcaSplit() ? TCA0_LUNF_vect : TCA0_CMP0_vect; flags = &TCA0.SINGLE.INTFLAGS; bit = tcaFlag();
+        } else if(TCB1.INTFLAGS & TCB1.INTCTRL & 0b00000001){
+            handler = TCB1_INT_vect; flags = &TCB1.INTFLAGS; bit = 0b00000001;
+        } else if(ADC0.INTFLAGS & ADC0.INTCTRL & 0b00000001){
+            handler = ADC0_RESRDY_vect; adcBit = 0b00000001;
+        } else if(ADC0.INTFLAGS & ADC0.INTCTRL & 0b00000010){
+            handler = ADC0_WCMP_vect; adcBit = 0b00000010;
+        } else if(USART1.STATUS & USART1.CTRLA & 0b00100000){
+            handler = USART1_DRE_vect; flags = &USART1.STATUS; bit = 0b00100000;
+        } else if(USART1.STATUS & USART1.CTRLA & 0b01000000){
+            handler = USART1_TXC_vect; flags = &USART1.STATUS; bit = 0b01000000;
+        } else {
+            break;
+        }
+
+        if(!handler){
+            stamp();
+            printf("sim   interrupt enabled with no handler, the device would reset\n");
+            exit(2);
+        }
+        SREG &= 0b01111111;
+        handler();
+        SREG |= 0b10000000;
+        if(adcBit){
+            adcFlags &= ~adcBit;
+        } else {
+            *flags &= ~bit; // the real flags are write-one-to-clear, the handler cleared it
+        }
+        sync();
+        handled++;
+        ran++;
+    }
+    return ran;
+}
+
+// time of the next thing any model has to do
+static uint64_t nextEvent(void){
+    uint64_t next = endTime;
+    if(stepNext < stepCount && steps[stepNext].at < next){
+        next = steps[stepNext].at;
+    }
+    if(pitOn){
+        uint64_t period = 4ULL << ((RTC.PITCTRLA >> 3) & 0b1111) >> 1;
+        uint64_t tick = rtcTicksAt(now) - pitBase;
+        uint64_t t = rtcTickTime(pitBase + (tick / period + 1) * period);
+        if(t < next){ next = t; }
+    }
+    if(rtcOn && (RTC.INTCTRL & 0b00000011)){
+        uint16_t cnt = rtcTicksAt(now) - rtcBase;
+        uint16_t ahead = RTC.CMP - cnt;
+        uint64_t t = rtcTickTime(rtcTicksAt(now) + (ahead ? ahead : 0x10000));
+        if((RTC.INTCTRL & 0b00000010) && t < next){ next = t; }
+        t = rtcTickTime(rtcBase + ((rtcTicksAt(now) - rtcBase) / 0x10000 + 1) * 0x10000);
+        if((RTC.INTCTRL & 0b00000001) && t < next){ next = t; }
+    }
+    if(tcaRunning()){
+        uint64_t period = tcaPeriod();
+        if(period){
+            uint64_t t = tcaBase + ((now - tcaBase) / period + 1) * period;
+            if(t < next){ next = t; }
+        }
+    }
+    if(tcbOn){
+        uint64_t top = (uint64_t)TCB1.CCMP + 1;
+        uint64_t t = tcbBase + (uint64_t)(((tcbWraps + 1) * top - tcbBaseCnt) * cycleNs()) + 1;
+        if(t < next){ next = t; }
+    }
+    if(adcDone < next){
+        next = adcDone;
+    }
+    uint64_t trigger = adcTriggerPeriod();
+    if(trigger && adcDone == NEVER && adcRunning()){
+        uint64_t tick = rtcTicksAt(now) - pitBase;
+        uint64_t t = rtcTickTime(pitBase + (tick / trigger + 1) * trigger);
+        if(t < next){ next = t; }
+    }
+    if(txEnd < next){
+        next = txEnd;
+    }
+    return next;
+}
+
+// counts the time up to t towards the awake totals
+static void awake(uint64_t t){
+    if(sleeping == 1){
+        idleNs += t - now;
+    }
+    if(!sleeping){
+        awakeNs += t - now;
+        if(clockHz == 4000000){
+            awakeSlowNs += t - now;
+        }
+    }
+}
+
+// moves virtual time to t, running every event on the way
+static void advance(uint64_t t){
+    while(1){
+        sync();
+        uint64_t next = nextEvent();
+        if(next > t){
+            break;
+        }
+        uint64_t before = now;
+        awake(next);
+        now = next;
+        sync();
+
+        if(now >= endTime){
+            finish();
+        }
+        while(stepNext < stepCount && steps[stepNext].at <= now){
+            ladderLevel = steps[stepNext++].level;
+        }
+        if(pitOn){
+            uint64_t period = 4ULL << ((RTC.PITCTRLA >> 3) & 0b1111) >> 1;
+            if((rtcTicksAt(now) - pitBase) / period != (rtcTicksAt(before) - pitBase) / period){
+                RTC.PITINTFLAGS |= 0b00000001;
+            }
+        }
+        if(rtcOn && RTC.CNT == RTC.CMP && rtcTicksAt(before) != rtcTicksAt(now)){
+            RTC.INTFLAGS |= 0b00000010;
+        }
+        if(rtcOn && (rtcTicksAt(now) - rtcBase) / 0x10000 != (rtcTicksAt(before) - rtcBase) / 0x10000){
+            RTC.INTFLAGS |= 0b00000001;     // counter passed PER (0xffff)
+        }
+        if(tcaRunning()){
+            uint64_t period = tcaPeriod();
+            if(period && (now - tcaBase) % period == 0 && now != tcaBase){
+                TCA0.SINGLE.INTFLAGS |= tcaFlag();
+            }
+        }
+        if(now >= txEnd){
+            txEnd = NEVER;
+            if(txFull){
+                txFull = 0;
+                txStart(txByte);
+            } else {
+                txComplete = 1;
+            }
+            sync();
+        }
+        if(now >= adcDone){
+            adcConversions += adcSamples();
+            ADC0.RES = ladderLevel * adcSamples();
+            adcFlags |= adcWindow(ADC0.RES) ? 0b00000011 : 0b00000001;
+            adcDone = (ADC0.CTRLA & 0b00000010) ? now + adcConversion() : NEVER;
+            sync();
+        }
+        uint64_t trigger = adcTriggerPeriod();
+        if(trigger && adcDone == NEVER && adcRunning()
+           && (rtcTicksAt(now) - pitBase) / trigger != (rtcTicksAt(before) - pitBase) / trigger){
+            adcDone = now + adcConversion();    // PIT event started a conversion
+        }
+        service();
+    }
+    awake(t);
+    now = t;
+    sync();
+}
+
+static void lcdStep(int right){
+    if(right){
+        lcdAddr++;
+        if(lcdAddr == 0x28){ lcdAddr = 0x40; }
+        else if(lcdAddr == 0x68){ lcdAddr = 0x00; }
+    } else {
+        if(lcdAddr == 0x00){ lcdAddr = 0x67; }
+        else if(lcdAddr == 0x40){ lcdAddr = 0x27; }
+        else { lcdAddr--; }
+    }
+}
+
+static void lcdExecute(uint8_t b, int rs){
+    uint64_t busy = 37000;
+    if(rs){
+        ddram[lcdAddr] = b;
+        lcdStep(lcdIncrement);
+        busy = 41000;
+    } else if(b & 0b10000000){
+        lcdAddr = b & 0b01111111;
+    } else if(b & 0b00100000){
+        lcdFourBit = !(b & 0b00010000);
+    } else if(b & 0b00010000){
+        if(!(b & 0b00001000)){
+            lcdStep(b & 0b00000100);    // cursor shift, display shift is not used
+        }
+    } else if(b & 0b00001000){
+        // display on/off, nothing to model
+    } else if(b & 0b00000100){
+        lcdIncrement = (b & 0b00000010) != 0;
+    } else if(b & 0b00000010){
+        lcdAddr = 0;
+        busy = 1520000;
+    } else if(b == 0b00000001){
+        memset(ddram, ' ', sizeof(ddram));
+        lcdAddr = 0;
+        lcdIncrement = 1;
+        busy = 1520000;
+    }
+    lcdReady = now + busy;
+}
+
+// with R/W (PD6) high the LCD drives the busy flag and address counter onto PA7-4 while EN
+// is high, high nibble first on the 4-bit interface
+static void lcdRead(void){
+    uint8_t status = (now < 40000000ULL || now < lcdReady ? 0b10000000 : 0) | lcdAddr;
+    uint8_t nibble = status >> 4;
+    if(PORTA.DIR & 0b11110000){
+        if(!lcdViolations){
+            stamp();
+            printf("lcd   read while PA7-4 still drive the data lines\n");
+        }
+        lcdViolations++;
+    }
+    if(lcdFourBit){
+        if(lcdReadLow){
+            nibble = status & 0b00001111;
+        }
+        lcdReadLow = !lcdReadLow;
+    }
+    PORTA.IN = (PORTA.IN & 0b00001111) | nibble << 4;
+}
+
+// the LCD latches PA7-4 while EN (PA2) is high, enable() holds it there in a delay
+static void lcdLatch(void){
+    uint8_t out = PORTA.OUT;
+    if(!(PORTA.DIR & 0b00000100) || !(out & 0b00000100)){
+        return;
+    }
+    if((PORTD.DIR & PORTD.OUT) & 0b01000000){
+        lcdRead();
+        return;
+    }
+    lcdReadLow = 0;
+    if(now < 40000000ULL || now < lcdReady){
+        if(!lcdViolations){
+            stamp();
+            printf("lcd   written %s\n", now < 40000000ULL ? "before the 40ms power-up time" : "while still busy");
+        }
+        lcdViolations++;
+    }
+    uint8_t nibble = out >> 4;
+    int rs = (out & 0b00001000) != 0;
+    if(!lcdFourBit){
+        lcdExecute(nibble << 4, rs);    // 8-bit interface until told otherwise, DB3-0 read as 0
+    } else if(!lcdHaveHigh){
+        lcdHigh = nibble;
+        lcdHaveHigh = 1;
+    } else {
+        lcdHaveHigh = 0;
+        lcdExecute(lcdHigh << 4 | nibble, rs);
+    }
+}
+
+// CPU time: firmware compiled with -fsanitize-coverage=trace-pc calls this at the start of
+// every basic block. Each block is charged SIM_BLOCK_CYCLES, a few AVR instructions and a
+// branch, at the next delay, sleep, cli() or sei(), so code that never waits takes time too.
+// Without the flag nothing calls it and code between waits runs in zero time.
+#define SIM_BLOCK_CYCLES 6
+void __sanitizer_cov_trace_pc(void){
+    cpuBlocks++;
+    cpuCharged = 1;
+}
+static void charge(void){
+    if(!cpuBlocks || charging){
+        return;     // interrupts run while time is charged are counted at the next call
+    }
+    uint64_t t = now + (uint64_t)(cpuBlocks * SIM_BLOCK_CYCLES * cycleNs());
+    cpuBlocks = 0;
+    charging = 1;
+    advance(t);
+    charging = 0;
+}
+
+void sim_delay_loops(uint16_t loops){
+    charge();
+    sync();
+    lcdLatch();
+    advance(now + (uint64_t)(4.0 * (loops ? loops : 65536) * cycleNs()));
+}
+void sim_sei(void){
+    charge();
+    sync();
+    SREG |= 0b10000000;
+    service();
+}
+void sim_cli(void){
+    charge();
+    sync();
+    SREG &= 0b01111111;
+}
+void sim_sleep(void){
+    charge();
+    if(!(SLPCTRL.CTRLA & 0b00000001)){
+        return;
+    }
+    report();
+    sleeping = (SLPCTRL.CTRLA & 0b00000110) ? 2 : 1;
+    unsigned long before = handled;
+    while(handled == before){
+        uint64_t next = nextEvent();
+        if(next == endTime && stepNext == stepCount && !(pitOn && (RTC.PITINTCTRL & 0b00000001))
+           && !(rtcOn && (RTC.INTCTRL & 0b00000011))){
+            stamp();
+            printf("sim   asleep with nothing left to wake the core\n");
+            exit(2);
+        }
+        advance(next);
+    }
+    sleeping = 0;
+    sync();
+}
+
+static uint16_t buttonLevel(const char *name){
+    // middle of each ladder window the firmware decodes
+    if(!strcmp(name, "select")){ return 0xf00; }
+    if(!strcmp(name, "left")){ return 0x266; }
+    if(!strcmp(name, "right")){ return 0x428; }
+    if(!strcmp(name, "up")){ return 0x63d; }
+    if(!strcmp(name, "down")){ return 0x9c2; }
+    fprintf(stderr, "sim: unknown button %s\n", name);
+    _Exit(2);
+}
+
+__attribute__((constructor)) static void simStart(int argc, char **argv){
+    setvbuf(stdout, 0, _IOLBF, 0);
+
+    // reset values the firmware relies on
+    RTC.PER = 0xffff;
+    TCA0.SINGLE.PER = 0xffff;
+    CLKCTRL.OSCHFCTRLA = oschf = 0b00001100;
+    CLKCTRL.MCLKSTATUS = 0b00000010;    // OSCHF stable, the sim switches frequency at once
+    memset(ddram, ' ', sizeof(ddram));
+    USART1.TXDATAL = SIM_TXDATA_EMPTY;
+    ADC0.INTFLAGS = SIM_FLAGS_UNWRITTEN;
+    USART1.CTRLC = 0b00000011;
+    memset(sim_eeprom, 0xff, sizeof(sim_eeprom));   // erased
+    memset(eepromShown, 0xff, sizeof(eepromShown));
+    atexit(mainReturned);
+
+    if(argc < 2){
+        return;
+    }
+    FILE *script = fopen(argv[1], "r");
+    if(!script){
+        perror(argv[1]);
+        _Exit(2);
+    }
+    char line[128];
+    double ladderPercent = 100;
+    while(fgets(line, sizeof(line), script)){
+        char name[32];
+        double at;
+        double hold = 150;
+        if(line[0] == '#' || sscanf(line, "%lf %31s %lf", &at, name, &hold) < 2){
+            if(sscanf(line, "end %lf", &at) == 1){
+                endTime = at * NS;
+            }
+            sscanf(line, "ladder %lf", &ladderPercent);
+            char path[256];
+            if(sscanf(line, "trace %255s", path) == 1){
+                if(!strcmp(path, "pty")){
+                    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+                    if(fd < 0 || grantpt(fd) || unlockpt(fd)){
+                        perror("sim: pty");
+                        _Exit(2);
+                    }
+                    fcntl(fd, F_SETFL, O_NONBLOCK);     // never hold up the sim
+                    txOut = fdopen(fd, "wb");
+                    printf("sim   trace on %s\n", ptsname(fd));
+                    fflush(stdout);
+                } else if(!(txOut = fopen(path, "wb"))){
+                    perror(path);
+                    _Exit(2);
+                }
+            }
+            if(sscanf(line, "eeprom %255s", eepromFile) == 1){
+                FILE *f = fopen(eepromFile, "rb");
+                if(f){
+                    if(fread(sim_eeprom, 1, EEPROM_SIZE, f) != EEPROM_SIZE){
+                        fprintf(stderr, "sim: %s is not %d bytes\n", eepromFile, EEPROM_SIZE);
+                        _Exit(2);
+                    }
+                    fclose(f);
+                    memcpy(eepromShown, sim_eeprom, EEPROM_SIZE);
+                }
+            }
+            continue;
+        }
+        if(stepCount + 2 > MAX_STEPS){
+            break;
+        }
+        steps[stepCount].at = at * NS;
+        steps[stepCount++].level = buttonLevel(name) * ladderPercent / 100;
+        steps[stepCount].at = at * NS + hold * 1000000;
+        steps[stepCount++].level = 0;
+    }
+    fclose(script);
+}
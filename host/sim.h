@@ -0,0 +1,171 @@
+/*
+ * File:   sim.h
+ * Host stand-in for <avr/io.h>, <avr/interrupt.h>, <avr/sleep.h> and <util/delay_basic.h>
+ *
+ * Built with -DHOST_SIM the firmware includes this header instead of the AVR ones, so the
+ * same session logic runs as a normal Linux program. The registers below are plain
+ * variables with the AVR128DB28 names, sim.c moves virtual time forward whenever the
+ * firmware waits (_delay_loop_2) or sleeps (sleep_cpu) and updates them the way the real
+ * peripherals would: TCA0 and TCB1 counters, the RTC counter and PIT, the ADC reading the
+ * button ladder (free-running or started by PIT events through EVSYS) with its window
+ * comparator, USART1 sending and an HD44780 model watching PA7-2 and R/W on PD6. The EEPROM is a plain
+ * array that sim.c can load from and save to a file, NVMCTRL commands are not checked.
+ */
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+
+typedef volatile uint8_t register8_t;
+typedef volatile uint16_t register16_t;
+
+typedef struct {
+    register8_t DIR, DIRSET, DIRCLR, DIRTGL;
+    register8_t OUT, OUTSET, OUTCLR, OUTTGL;
+    register8_t IN, INTFLAGS, PORTCTRL, PINCONFIG;
+    register8_t PINCTRLUPD, PINCTRLSET, PINCTRLCLR;
+    register8_t PIN0CTRL, PIN1CTRL, PIN2CTRL, PIN3CTRL, PIN4CTRL, PIN5CTRL, PIN6CTRL, PIN7CTRL;
+} PORT_t;
+
+// VPORTx on the part is a second, single-cycle view of the same PORTx registers; here it is
+// laid over PORT_t so VPORTA.OUT and PORTA.OUT are the same byte. The OUTSET/OUTCLR/OUTTGL
+// strobes are applied when sim.c next syncs, so only the last write to each shows if the
+// firmware writes one twice without delaying, sleeping or touching interrupts in between.
+typedef struct {
+    register8_t DIR, reserved_1[3], OUT, reserved_2[3], IN, INTFLAGS;
+} VPORT_t;
+
+// TCA0 laid out as on the part, so the SINGLE and SPLIT views alias the same bytes
+typedef struct {
+    register8_t CTRLA, CTRLB, CTRLC, CTRLD, CTRLECLR, CTRLESET, CTRLFCLR, CTRLFSET;
+    register8_t reserved_1, EVCTRL, INTCTRL, INTFLAGS, reserved_2[2], DBGCTRL, TEMP;
+    register8_t reserved_3[16];
+    register16_t CNT;
+    register8_t reserved_4[4];
+    register16_t PER, CMP0, CMP1, CMP2;
+    register8_t reserved_5[8];
+    register16_t PERBUF, CMP0BUF, CMP1BUF, CMP2BUF;
+} TCA_SINGLE_t;
+
+typedef struct {
+    register8_t CTRLA, CTRLB, CTRLC, CTRLD, CTRLECLR, CTRLESET;
+    register8_t reserved_1[4], INTCTRL, INTFLAGS, reserved_2[2], DBGCTRL;
+    register8_t reserved_3[17];
+    register8_t LCNT, HCNT;
+    register8_t reserved_4[4];
+    register8_t LPER, HPER, LCMP0, HCMP0, LCMP1, HCMP1, LCMP2, HCMP2;
+} TCA_SPLIT_t;
+
+typedef union {
+    TCA_SINGLE_t SINGLE;
+    TCA_SPLIT_t SPLIT;
+} TCA_t;
+
+typedef struct {
+    register8_t CTRLA, CTRLB, EVCTRL, INTCTRL, INTFLAGS, STATUS, DBGCTRL, TEMP;
+    register16_t CNT, CCMP;
+} TCB_t;
+
+typedef struct {
+    register8_t CTRLA, STATUS, INTCTRL, INTFLAGS, TEMP, DBGCTRL, CALIB, CLKSEL;
+    register16_t CNT, PER, CMP;
+    register8_t PITCTRLA, PITSTATUS, PITINTCTRL, PITINTFLAGS, PITDBGCTRL, PITEVGENCTRLA;
+} RTC_t;
+
+// INTFLAGS is wider than on the part: sim.c keeps SIM_FLAGS_UNWRITTEN in the high byte, so a
+// firmware write shows and clears the flags it writes ones to
+#define SIM_FLAGS_UNWRITTEN 0xff00
+typedef struct {
+    register8_t CTRLA, CTRLB, CTRLC, CTRLD, CTRLE, SAMPCTRL, MUXPOS, MUXNEG;
+    register8_t COMMAND, EVCTRL, INTCTRL;
+    register16_t INTFLAGS;
+    register8_t DBGCTRL, TEMP;
+    register16_t RES, WINLT, WINHT;
+    register8_t CALIB, PGACTRL;
+} ADC_t;
+
+typedef struct {
+    register8_t ADC0REF, DAC0REF, ACREF;
+} VREF_t;
+
+typedef struct {
+    register8_t MCLKCTRLA, MCLKCTRLB, MCLKCTRLC, MCLKINTCTRL, MCLKINTFLAGS, MCLKSTATUS, MCLKTIMEBASE;
+    register8_t OSCHFCTRLA, OSCHFTUNE, OSC32KCTRLA, XOSC32KCTRLA, XOSCHFCTRLA;
+} CLKCTRL_t;
+
+typedef struct {
+    register8_t CTRLA, CTRLB, VREGCTRL;
+} SLPCTRL_t;
+
+typedef struct {
+    register8_t CTRLA, CTRLB, CTRLC, reserved_1, INTCTRL, INTFLAGS, STATUS;
+} NVMCTRL_t;
+
+// TXDATAL is wider than on the part: sim.c parks it at SIM_TXDATA_EMPTY so every byte the
+// firmware writes shows, even the same one twice
+#define SIM_TXDATA_EMPTY 0xffff
+typedef struct {
+    register8_t RXDATAL, RXDATAH;
+    register16_t TXDATAL;
+    register8_t TXDATAH, STATUS, CTRLA, CTRLB, CTRLC;
+    register16_t BAUD;
+    register8_t CTRLD, DBGCTRL, EVCTRL, TXPLCTRL, RXPLCTRL;
+} USART_t;
+
+// only the event channels and the ADC0 start user
+typedef struct {
+    register8_t SWEVENTA, SWEVENTB;
+    register8_t CHANNEL0, CHANNEL1, CHANNEL2, CHANNEL3, CHANNEL4, CHANNEL5, CHANNEL6, CHANNEL7, CHANNEL8, CHANNEL9;
+    register8_t USERADC0START;
+} EVSYS_t;
+
+typedef struct {
+    register8_t EVSYSROUTEA, CCLROUTEA, USARTROUTEA, USARTROUTEB, SPIROUTEA, TWIROUTEA;
+    register8_t TCAROUTEA, TCBROUTEA, TCDROUTEA, ACROUTEA, ZCDROUTEA;
+} PORTMUX_t;
+
+extern PORT_t PORTA, PORTC, PORTD;
+#define VPORTA (*(VPORT_t *)&PORTA)
+#define VPORTD (*(VPORT_t *)&PORTD)
+extern TCA_t TCA0;
+extern TCB_t TCB1;
+extern RTC_t RTC;
+extern ADC_t ADC0;
+extern VREF_t VREF;
+extern CLKCTRL_t CLKCTRL;
+extern SLPCTRL_t SLPCTRL;
+extern EVSYS_t EVSYS;
+extern PORTMUX_t PORTMUX;
+extern NVMCTRL_t NVMCTRL;
+extern USART_t USART1;
+extern register8_t CCP;
+extern register8_t SREG;
+
+// interrupts: the firmware's handlers become plain functions sim.c calls
+#define ISR(vector) void vector(void)
+#define sei() sim_sei()
+#define cli() sim_cli()
+
+// writes a register under configuration change protection, sim.c ignores writes without it
+#define _PROTECTED_WRITE(reg, value) do { CCP = 0xD8; (reg) = (value); } while(0)
+#define _PROTECTED_WRITE_SPM(reg, value) do { CCP = 0x9D; (reg) = (value); } while(0)
+
+// the EEPROM is mapped into data space on the part, here it is an array in sim.c
+#define EEPROM_SIZE 512
+extern uint8_t sim_eeprom[EEPROM_SIZE];
+#define EEPROM_START ((uintptr_t)sim_eeprom)
+
+// flash is ordinary memory on the host
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+
+// waits and sleep are where virtual time moves on
+#define sleep_cpu() sim_sleep()
+#define _delay_loop_2(loops) sim_delay_loops(loops)
+
+void sim_sei(void);
+void sim_cli(void);
+void sim_sleep(void);
+void sim_delay_loops(uint16_t loops);
+
+#endif